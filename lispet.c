@@ -3,19 +3,34 @@
 #include <assert.h>
 #include "mpc.h"
 #include <math.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <setjmp.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define LARR_SIMD
+#endif
 
-#define LASSERT(args, cond, fmt, ...) \
-    if (!(cond)) {lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err;}
+#define LASSERT(args, cond, ...) \
+    if (!(cond)) {lval* err = lval_err(__VA_ARGS__); lval_del(args); return err;}
 
 #define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect,    \
-        "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-            func, index, ltype_name(args->cell[index]->type), ltype_name(expect)) 
+    if (args->cell[index]->type != expect) { \
+        lval* err = lval_err_type(func, index, args->cell[index]->type, expect); \
+        lval_del(args); return err;}
         
 #define LASSERT_NUM(func, args, expect)                \
-    LASSERT(args, args->count == expect, \
-        "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-            func, args->count, expect)
+    if (args->count != expect) { \
+        lval* err = lval_err_arity(func, args->count, expect); \
+        lval_del(args); return err;}
+
+#define LASSERT_INDEX(func, args, v, i, end)                           \
+    LASSERT(args, (i >= 0 && i < v->count + end),                       \
+        "Function '%s' passed index %li out of range. Expected 0 to %li.", \
+            func, i, (long)v->count + end - 1)
 
 #ifdef _WIN32
 
@@ -44,40 +59,112 @@ void add_history(char * unused){}
 //Forward Declarations
 struct lval;
 struct lenv;
+struct lmemo;
+struct lseq;
+struct lmap;
+struct lvec;
+struct larr;
+struct lmat;
+struct lbig;
+struct lbuf;
+struct lstr;
+struct lmatch;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmemo lmemo;
+typedef struct lseq lseq;
+typedef struct lmap lmap;
+typedef struct lvec lvec;
+typedef struct larr larr;
+typedef struct lmat lmat;
+typedef struct lbig lbig;
+typedef struct lbuf lbuf;
+typedef struct lstr lstr;
+typedef struct lmatch lmatch;
 mpc_parser_t* Number;
+mpc_parser_t* Double;
 mpc_parser_t* Symbol;
 mpc_parser_t* String;
 mpc_parser_t* Comment;
 mpc_parser_t* Sexpr;
 mpc_parser_t* Qexpr;
+mpc_parser_t* Map;
 mpc_parser_t* Expr;
 mpc_parser_t* Lispy;
 
+//moved whenever a global function binding changes, so bodies optimized
+//against the old bindings are known to be stale
+static long lenv_epoch = 0;
+
+//strings up to this long are kept inside the lval
+#define LSTR_INLINE 22
+
 //Lval Types
-enum {LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR};
+enum {LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_SEQ, LVAL_RECUR, LVAL_MAP, LVAL_VEC, LVAL_ARR, LVAL_MAT, LVAL_DBL, LVAL_BIG, LVAL_BUF, LVAL_MATCH};
 
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
 struct lval{
     int type;
-
-    // Basic
-    long num;
-    char* err;
-    char* sym;
-    char* str;
-
-    // Function
-    lbuiltin builtin;
-    lenv* env;
-    lval* formals;
-    lval* body;
-
-    // Expression
-    int count;
-    lval ** cell;
+    int rc;             // references to a shared immutable node, 0 if owned
+    int interned;       // canonical node from the hash-consing table
+    unsigned long hash; // cached when interned
+
+    // Payload, only the fields of the node's type are in use
+    union {
+        long num;
+        double dbl;
+        char* sym;
+
+        // Error
+        struct {
+            char* err;          // message, NULL until it is first needed
+            int ecode;
+            const char* efunc;  // function named by the message, never freed
+            long eargs[3];
+            lval* esym;         // unbound symbol
+        };
+
+        // String
+        struct {
+            char* str;      // the characters, in 'sinl' or in 'sbuf'
+            long slen;
+            lstr* sbuf;     // shared characters of long strings, NULL if inline
+            char sinl[LSTR_INLINE + 1];
+        };
+
+        // Function, a builtin only sets 'builtin', 'memo' and 'macro'
+        struct {
+            lbuiltin builtin;
+            lmemo* memo;  // table of earlier results, shared by all copies
+            int macro;    // given its argument forms and expanded in their place
+            lenv* env;
+            lval* formals;
+            lval* body;
+            lval* code;   // optimized body, valid while epoch is current
+            long epoch;
+        };
+
+        // Expression
+        struct {
+            int count;
+            lval ** cell;
+        };
+
+        // Map
+        struct {
+            lmap* map;
+            int literal;  // read from source, evaluates to a fresh map
+        };
+
+        lseq* seq;      // lazy sequence
+        lvec* vec;      // vector
+        larr* arr;      // typed array
+        lmat* mat;      // matrix
+        lbig* big;      // bignum
+        lbuf* buf;      // string builder
+        lmatch* match;  // compiled patterns
+    };
 };
 
 struct lenv{
@@ -85,24 +172,231 @@ struct lenv{
     int count;
     char ** syms;
     lval** vals;
+    int* sealed;
+};
+
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo_entry{
+    unsigned long hash;
+    lval* args;
+    lval* result;
+    lmemo_entry* chain;             // next in bucket
+    lmemo_entry* newer;             // LRU order
+    lmemo_entry* older;
+};
+
+struct lmemo{
+    int refs;
+    int capacity;
+    int count;
+    long hits;
+    long misses;
+    int size;                       // number of buckets, a power of two
+    lmemo_entry** buckets;
+    lmemo_entry* newest;
+    lmemo_entry* oldest;
+};
+
+//Lazy sequence kinds
+enum {SEQ_RANGE, SEQ_ITERATE, SEQ_LIST, SEQ_MAP, SEQ_FILTER, SEQ_TAKE, SEQ_DROP};
+
+//sequences only describe how to produce their elements, they are shared
+//by all copies and never change
+struct lseq{
+    int refs;
+    int kind;
+    lseq* src;      // sequence transformed by map, filter, take and drop
+    lval* fun;      // function of iterate, map and filter
+    lval* val;      // list of a list sequence, first value of iterate
+    long start;     // range bounds, count of take and drop
+    long end;
+    long step;
 };
 
 static void lval_del(lval* v);
+static void lmemo_del(lmemo* m);
+static void lseq_del(lseq* s);
+
+typedef struct {
+    lval* key;      // NULL once deleted
+    lval* val;
+    unsigned long hash;
+} lmap_entry;
+
+//maps are shared by reference, entries are kept in insertion order and
+//found through an open-addressing index of slots
+struct lmap{
+    int refs;
+    int count;      // live entries
+    int used;       // entries, deleted ones included
+    int cap;
+    int size;       // slots in the index, a power of two
+    int* index;     // entry of each slot, MAP_EMPTY or MAP_DELETED
+    lmap_entry* entries;
+};
+
+static void lmap_del(lmap* m);
+static lval* lmap_get(lmap* m, lval* k);
+
+//vectors are shared by reference, as long as every element is a number
+//they are stored unboxed
+struct lvec{
+    int refs;
+    int count;
+    int cap;
+    int boxed;
+    long* nums;     // elements while unboxed
+    lval** items;   // elements once boxed
+};
+
+static void lvec_del(lvec* v);
+
+//arrays hold numbers only, unboxed, and never change once built
+struct larr{
+    int refs;
+    long count;
+    long* data;     // int64 elements
+    double* fdata;  // double elements, used instead of data when set
+};
+
+static void larr_del(larr* a);
+
+//row-major matrices of doubles, they never change once built
+struct lmat{
+    int refs;
+    long rows;
+    long cols;
+    double* data;
+};
+
+static void lmat_del(lmat* m);
+
+//integers beyond a long, sign and magnitude, never change once built
+struct lbig{
+    int refs;
+    int neg;
+    int count;      // limbs in use
+    unsigned* d;    // 32 bit limbs, least significant first
+};
+
+static void lbig_del(lbig* b);
+
+//growing text, changed in place by sb-append and seen by every copy
+struct lbuf{
+    int refs;
+    long len;
+    long cap;
+    char* s;        // always terminated
+};
+
+static void lbuf_del(lbuf* b);
+
+//characters of a long string, shared by every copy and never changed
+struct lstr{
+    int refs;
+    char s[];
+};
+
+//Pattern test kinds
+enum {LPAT_LEN, LPAT_MIN, LPAT_EQ};
+
+//a test on the part of a matched value reached by following 'path' through
+//cells: a list of exactly or at least n elements, or equal to a literal
+typedef struct {
+    int kind;
+    int depth;
+    int* path;
+    long n;
+    lval* lit;
+} lptest;
+
+//a variable bound to a part of the value, or with 'rest' set to the list of
+//its cells from 'rest' on
+typedef struct {
+    lval* sym;
+    int depth;
+    int* path;
+    int rest;
+} lpbind;
+
+typedef struct {
+    int ntests;
+    lptest* tests;  // lists come before their elements
+    int nbinds;
+    lpbind* binds;
+    lval* body;
+} lpclause;
+
+//inner nodes run a test, leaves choose a clause, or none with -1
+typedef struct lpnode {
+    lptest* test;
+    int clause;
+    struct lpnode* yes;
+    struct lpnode* no;
+} lpnode;
+
+//the clauses of 'match' and their decision tree, shared by every copy and
+//never changed
+struct lmatch{
+    int refs;
+    int count;
+    lpclause* clauses;
+    lpnode* root;
+};
+
+static void lmatch_del(lmatch* m);
+static void lbig_write(lbuf* out, lbig* b);
+static lbig* lbig_read(char* s);
+static lval* lval_big(lbig* b);
 static lval* lval_err(char * fmt, ...);
+static lval* lval_err_type(const char* func, long index, int got, int expect);
+static lval* lval_err_arity(const char* func, long got, long expect);
+static lval* lval_err_unbound(lval* sym);
 static lval* lval_copy(lval* v);
+static void lval_canon_remove(lval* v);
 
 static lval* lval_pop(lval* v, int i);
 static lval* lval_take(lval* v, int i);
 
 lval* lval_call(lenv* e, lval* f, lval*a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_def(lenv*e, lval* a);
+lval* builtin_put(lenv*e, lval* a);
+static lval* builtin_lambda(lenv* e, lval* a);
+static lval* lmacro_expand(lenv* e, lval* v, int body);
+static lval* lmacro_eval(lenv* e, lval* m, lval* a);
+
+static lval* lval_alloc(int type)
+{
+    lval* v = malloc(sizeof(lval));
+    v->type = type;
+    v->rc = 0;
+    v->interned = 0;
+    return v;
+}
+
+//a string of the 'n' characters at 's'
+static lval* lval_str_n(const char* s, long n)
+{
+    lval* v = lval_alloc(LVAL_STR);
+    v->slen = n;
+    if(n <= LSTR_INLINE){
+        v->sbuf = NULL;
+        v->str = v->sinl;
+    }else{
+        v->sbuf = malloc(sizeof(lstr) + n + 1);
+        v->sbuf->refs = 1;
+        v->str = v->sbuf->s;
+    }
+    memcpy(v->str, s, n);
+    v->str[n] = '\0';
+    return v;
+}
 
 lval* lval_str(char* s)
 {
-     lval* v = malloc(sizeof(lval));
-     v->type = LVAL_STR;
-     v->str = malloc(strlen(s) + 1);
-     strcpy(v->str, s);
-     return v;
+    return lval_str_n(s, strlen(s));
 }
 
 static char * ltype_name(int t)
@@ -115,22 +409,39 @@ static char * ltype_name(int t)
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_SEQ: return "Sequence";
+    case LVAL_RECUR: return "Recur";
+    case LVAL_MAP: return "Map";
+    case LVAL_VEC: return "Vector";
+    case LVAL_ARR: return "Array";
+    case LVAL_MAT: return "Matrix";
+    case LVAL_DBL: return "Double";
+    case LVAL_BIG: return "Bignum";
+    case LVAL_BUF: return "Builder";
+    case LVAL_MATCH: return "Pattern";
     default: return "Unknown";
     }
 }
 
 // construction functions
-static lenv* lenv_new(void)
+static void lenv_init(lenv* e)
 {
-    lenv* e = malloc(sizeof(lenv));
     e->par = NULL;
     e->count = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->sealed = NULL;
+}
+
+static lenv* lenv_new(void)
+{
+    lenv* e = malloc(sizeof(lenv));
+    lenv_init(e);
     return e;
 }
 
-static void lenv_del(lenv* e)
+//frees the bindings of 'e' but not 'e' itself
+static void lenv_clear(lenv* e)
 {
     for (int i = 0; i < e->count; i++) {
         free(e->syms[i]);
@@ -139,6 +450,12 @@ static void lenv_del(lenv* e)
 
     free(e->syms);
     free(e->vals);
+    free(e->sealed);
+}
+
+static void lenv_del(lenv* e)
+{
+    lenv_clear(e);
     free(e);
 }
 
@@ -152,20 +469,29 @@ static lval* lenv_get(lenv* e, lval* k)
     if(e->par){
         return lenv_get(e->par, k);
     }else{
-        return lval_err("unbound symbol '%s'!", k->sym);
+        return lval_err_unbound(k);
     }
 } 
 
-static void lenv_put(lenv* e, lval* k, lval* v)
+//look up a symbol in this environment only, without copying
+static lval* lenv_find(lenv* e, char* sym)
+{
+    for (int i = 0; i < e->count; i++) {
+        if(strcmp(e->syms[i], sym) == 0) { return e->vals[i];}
+    }
+    return NULL;
+}
+
+static void lenv_set(lenv* e, char* sym, lval* v)
 {
     //Check if variable already exists
     for (int i = 0; i < e->count; i++) {
-        if(strcmp(e->syms[i], k->sym) == 0) {
+        if(strcmp(e->syms[i], sym) == 0) {
             lval_del(e->vals[i]);
             e->vals[i] = lval_copy(v);
             // Why we need next two line? They are necessary.
-            e->syms[i] = realloc(e->syms[i], strlen(k->sym) + 1);
-            strcpy(e->syms[i], k->sym);
+            e->syms[i] = realloc(e->syms[i], strlen(sym) + 1);
+            strcpy(e->syms[i], sym);
             return;
         }
     }
@@ -174,10 +500,29 @@ static void lenv_put(lenv* e, lval* k, lval* v)
     e->count++;
     e->vals = realloc(e->vals, sizeof(lval*) * e->count);
     e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    e->sealed = realloc(e->sealed, sizeof(int) * e->count);
     e->vals[e->count-1] = lval_copy(v);
+    e->sealed[e->count-1] = 0;
     // Why we need next two line? They are necessary.
-    e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count-1], k->sym);
+    e->syms[e->count-1] = malloc(strlen(sym) + 1);
+    strcpy(e->syms[e->count-1], sym);
+}
+
+static void lenv_put(lenv* e, lval* k, lval* v) { lenv_set(e, k->sym, v);}
+
+//sealed symbols are bound once in the global environment and can never be
+//redefined or shadowed, so their values may be folded into code. Nothing
+//is sealed unless asked for
+static int lenv_seals = 0;
+
+static int lenv_sealed(lenv* e, char* sym)
+{
+    if(!lenv_seals) { return 0;}
+    while(e->par){e = e->par;}
+    for (int i = 0; i < e->count; i++) {
+        if(strcmp(e->syms[i], sym) == 0) { return e->sealed[i];}
+    }
+    return 0;
 }
 
 static void lenv_def(lenv*e, lval* k, lval*v)
@@ -191,8 +536,7 @@ static void lenv_def(lenv*e, lval* k, lval*v)
 
 static lval* lval_lambda(lval* formals, lval* body)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_alloc(LVAL_FUN);
 
     v->builtin = NULL;
 
@@ -202,41 +546,148 @@ static lval* lval_lambda(lval* formals, lval* body)
     //set formals and body
     v->formals = formals;
     v->body = body;
+    v->code = NULL;
+    v->epoch = 0;
+    v->memo = NULL;
+    v->macro = 0;
     return v;
 }
 
 static lval* lval_num(long x)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    lval* v = lval_alloc(LVAL_NUM);
     v->num = x;
     return v;
 }
 
+static lval* lval_dbl(double x)
+{
+    lval* v = lval_alloc(LVAL_DBL);
+    v->dbl = x;
+    return v;
+}
+
+// Errors
+//
+// The common errors only record what went wrong, the function and the
+// numbers involved. Their message is formatted the first time it is
+// printed or compared, so errors that are raised and then discarded by
+// 'select' or a failed probe cost no more than the node itself. Errors
+// without arguments are shared nodes made once.
+
+enum {LERR_TEXT, LERR_TYPE, LERR_ARITY, LERR_UNBOUND, LERR_DIVZERO, LERR_KINDS};
+
+static lval* lerr_new(int code)
+{
+    lval* v = lval_alloc(LVAL_ERR);
+    v->ecode = code;
+    v->err = NULL;
+    v->esym = NULL;
+    return v;
+}
+
+//the message, formatted into a buffer of exactly the right size
+static char* lerr_vformat(const char* fmt, va_list va)
+{
+    va_list vb;
+    va_copy(vb, va);
+    int n = vsnprintf(NULL, 0, fmt, va);
+    char* s = malloc(n + 1);
+    vsnprintf(s, n + 1, fmt, vb);
+    va_end(vb);
+    return s;
+}
+
+static char* lerr_format(const char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    char* s = lerr_vformat(fmt, va);
+    va_end(va);
+    return s;
+}
+
 static lval* lval_err(char * fmt, ...)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval* v = lerr_new(LERR_TEXT);
 
-    //create a va list and initialize it
     va_list va;
     va_start(va, fmt);
+    v->err = lerr_vformat(fmt, va);
+    va_end(va);	
 
-    v->err = malloc(512);
+    return v;
+}
+
+//an error with 's' as its message, taken literally
+static lval* lval_err_text(const char* s)
+{
+    lval* v = lerr_new(LERR_TEXT);
+    v->err = malloc(strlen(s) + 1);
+    strcpy(v->err, s);
+    return v;
+}
 
-    vsnprintf(v->err, 511, fmt, va);
+static lval* lval_err_type(const char* func, long index, int got, int expect)
+{
+    lval* v = lerr_new(LERR_TYPE);
+    v->efunc = func;
+    v->eargs[0] = index;
+    v->eargs[1] = got;
+    v->eargs[2] = expect;
+    return v;
+}
 
-    v->err = realloc(v->err, strlen(v->err) + 1);
-	
-    va_end(va);	
+static lval* lval_err_arity(const char* func, long got, long expect)
+{
+    lval* v = lerr_new(LERR_ARITY);
+    v->efunc = func;
+    v->eargs[0] = got;
+    v->eargs[1] = expect;
+    return v;
+}
 
+static lval* lval_err_unbound(lval* sym)
+{
+    lval* v = lerr_new(LERR_UNBOUND);
+    v->esym = lval_copy(sym);
     return v;
 }
 
+//a shared error with no arguments
+static lval* lval_err_const(int code)
+{
+    static lval* made[LERR_KINDS];
+    if(!made[code]){
+        made[code] = lerr_new(code);
+        made[code]->rc = 1;  // held here for good
+    }
+    return lval_copy(made[code]);
+}
+
+//the message of an error, formatted the first time it is asked for
+static char* lerr_text(lval* v)
+{
+    if(v->err) { return v->err;}
+
+    switch(v->ecode){
+    case LERR_TYPE:
+        v->err = lerr_format("Function '%s' passed incorrect type for argument %li. Got %s, Expected %s.",
+                             v->efunc, v->eargs[0], ltype_name(v->eargs[1]), ltype_name(v->eargs[2]));
+        break;
+    case LERR_ARITY:
+        v->err = lerr_format("Function '%s' passed incorrect number of arguments. Got %li, Expected %li.",
+                             v->efunc, v->eargs[0], v->eargs[1]);
+        break;
+    case LERR_UNBOUND: v->err = lerr_format("unbound symbol '%s'!", v->esym->sym); break;
+    case LERR_DIVZERO: v->err = lerr_format("Division by Zero!"); break;
+    }
+    return v->err;
+}
+
 static lval* lval_sym(char * s)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
+    lval* v = lval_alloc(LVAL_SYM);
     v->sym = malloc(strlen(s) + 1);
     strcpy(v->sym, s);
     return v;
@@ -244,16 +695,16 @@ static lval* lval_sym(char * s)
 
 static lval* lval_fun(lbuiltin func)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_alloc(LVAL_FUN);
     v->builtin = func;
+    v->memo = NULL;
+    v->macro = 0;
     return v;
 }
 
 static lval* lval_sexpr(void)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_alloc(LVAL_SEXPR);
     v->count = 0; 
     v->cell = NULL;
     return v;
@@ -261,8 +712,7 @@ static lval* lval_sexpr(void)
 
 static lval* lval_qexpr(void)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_alloc(LVAL_QEXPR);
     v->count = 0; 
     v->cell = NULL;
     return v;
@@ -270,22 +720,41 @@ static lval* lval_qexpr(void)
 
 static void lval_del(lval* v)
 {
+    //shared nodes go when the last reference does, canonical ones when
+    //only the table's is left
+    if(v->rc && --v->rc > v->interned) { return;}
+    if(v->interned) { lval_canon_remove(v);}
+
     switch (v->type) {
-    case LVAL_NUM: break;
+    case LVAL_NUM: case LVAL_DBL: break;
     case LVAL_FUN: 
         if(!v->builtin){
             lenv_del(v->env);
             lval_del(v->formals);
             lval_del(v->body);
+            if(v->code){lval_del(v->code);}
+            if(v->memo){lmemo_del(v->memo);}
         }
         break;
-    case LVAL_ERR: free(v->err); break;
+    case LVAL_ERR:
+        free(v->err);
+        if(v->esym) { lval_del(v->esym);}
+        break;
     case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
+    case LVAL_STR: if(v->sbuf && !--v->sbuf->refs) { free(v->sbuf);} break;
+    case LVAL_SEQ: lseq_del(v->seq); break;
+    case LVAL_MAP: lmap_del(v->map); break;
+    case LVAL_VEC: lvec_del(v->vec); break;
+    case LVAL_ARR: larr_del(v->arr); break;
+    case LVAL_MAT: lmat_del(v->mat); break;
+    case LVAL_BIG: lbig_del(v->big); break;
+    case LVAL_BUF: lbuf_del(v->buf); break;
+    case LVAL_MATCH: lmatch_del(v->match); break;
 
     // if Qexpr and Sexpr then delete all elements inside
     case LVAL_QEXPR:
     case LVAL_SEXPR:     
+    case LVAL_RECUR:
         for(int i = 0; i < v->count; i ++)
             lval_del(v->cell[i]);
         
@@ -303,6 +772,8 @@ static lenv* lenv_copy(lenv* e)
     n->count = e->count;
     n->syms = malloc(sizeof(char *) * n->count);
     n->vals = malloc(sizeof(lval*) * n->count);
+    n->sealed = malloc(sizeof(int) * n->count);
+    if(n->count) { memcpy(n->sealed, e->sealed, sizeof(int) * n->count);}
     for (int i = 0; i < e->count; i++) {
         n->syms[i] = malloc(strlen(e->syms[i]) + 1);
         strcpy(n->syms[i], e->syms[i]);
@@ -311,30 +782,58 @@ static lenv* lenv_copy(lenv* e)
     return n;
 }
 
-static lval* lval_copy(lval* v)
+//a new node with the contents of 'v', its children are copied
+static lval* lval_clone(lval* v)
 {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+    lval* x = lval_alloc(v->type);
     
     switch (v->type) {
     case LVAL_FUN:
+        x->macro = v->macro;
         if(v->builtin){
             x->builtin = v->builtin; 
+            x->memo = NULL;
         }else {
             x->builtin = v->builtin;
             x->env = lenv_copy(v->env);
             x->formals = lval_copy(v->formals);
             x->body = lval_copy(v->body);
+            x->code = v->code ? lval_copy(v->code) : NULL;
+            x->epoch = v->epoch;
+            x->memo = v->memo;
+            if(x->memo){x->memo->refs++;}
         }
         break;
     case LVAL_NUM: x->num = v->num; break;
-
-    case LVAL_ERR: x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err);break;
+    case LVAL_DBL: x->dbl = v->dbl; break;
+
+    case LVAL_ERR:
+        x->ecode = v->ecode;
+        x->efunc = v->efunc;
+        memcpy(x->eargs, v->eargs, sizeof(v->eargs));
+        x->esym = v->esym ? lval_copy(v->esym) : NULL;
+        x->err = NULL;
+        if(v->err) { x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err);}
+        break;
     case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1); strcpy(x->sym, v->sym);break;
-    case LVAL_STR: x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str);break;
+    case LVAL_STR:
+        x->slen = v->slen;
+        x->sbuf = v->sbuf;
+        if(x->sbuf) { x->sbuf->refs++; x->str = x->sbuf->s;}
+        else { x->str = x->sinl; memcpy(x->sinl, v->sinl, v->slen + 1);}
+        break;
+    case LVAL_SEQ: x->seq = v->seq; x->seq->refs++; break;
+    case LVAL_MAP: x->map = v->map; x->map->refs++; x->literal = v->literal; break;
+    case LVAL_VEC: x->vec = v->vec; x->vec->refs++; break;
+    case LVAL_ARR: x->arr = v->arr; x->arr->refs++; break;
+    case LVAL_MAT: x->mat = v->mat; x->mat->refs++; break;
+    case LVAL_BIG: x->big = v->big; x->big->refs++; break;
+    case LVAL_BUF: x->buf = v->buf; x->buf->refs++; break;
+    case LVAL_MATCH: x->match = v->match; x->match->refs++; break;
         
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+    case LVAL_RECUR:
         x->count = v->count;
         x->cell = malloc(sizeof(lval*) * x->count);
         for(int i = 0; i < x->count; i++){
@@ -345,8 +844,29 @@ static lval* lval_copy(lval* v)
     return x;
 }
 
+static lval* lval_copy(lval* v)
+{
+    //shared nodes are immutable, another reference will do. Functions are
+    //never changed once made, so they are shared from their first copy on
+    if(v->type == LVAL_FUN && !v->rc) { v->rc = 1;}
+    if(v->rc) { v->rc++; return v;}
+    return lval_clone(v);
+}
+
+//a node the caller is free to modify, taking the place of 'v'. Children of
+//a shared node are shared as well, so it is copied one level deep only
+static lval* lval_own(lval* v)
+{
+    if(!v->rc) { return v;}
+
+    lval* x = lval_clone(v);
+    lval_del(v);
+    return x;
+}
+
 static lval* lval_add(lval* v, lval* x)
 {
+    assert(!v->rc);
     v->count++;
     v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     v->cell[v->count - 1] = x;
@@ -355,6 +875,7 @@ static lval* lval_add(lval* v, lval* x)
 
 static lval* lval_add_front(lval* v, lval* x)
 {
+    assert(!v->rc);
     v->count++;
     v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     memmove(&v->cell[1], &v->cell[0], sizeof(lval*) * (v->count - 1));
@@ -364,8 +885,17 @@ static lval* lval_add_front(lval* v, lval* x)
 
 static lval* lval_read_num(mpc_ast_t* t)
 {
+    errno = 0;
     long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("invalid number '%s'", t->contents); 
+    //too big for a long, read it as a bignum
+    return errno != ERANGE ? lval_num(x) : lval_big(lbig_read(t->contents));
+}
+
+static lval* lval_read_dbl(mpc_ast_t* t)
+{
+    errno = 0;
+    double x = strtod(t->contents, NULL);
+    return errno != ERANGE ? lval_dbl(x) : lval_err("invalid double '%s'", t->contents);
 }
 
 static lval* lval_read_str(mpc_ast_t* t)
@@ -385,8 +915,147 @@ static lval* lval_read_str(mpc_ast_t* t)
     return str;
 }
 
+// Hash-consing
+//
+// With (hashcons 1), the reader returns one canonical node for every
+// distinct number, symbol, string and expression it reads, so literals
+// repeated across loaded files are stored once. Canonical nodes are shared
+// and immutable: copying one is O(1), two of them are equal exactly when
+// they are the same node and their hash is computed only once. The table
+// holds one reference to each, and a node leaves it once that is the last
+// one left. It is off by default.
+
+static int lval_hashcons = 0;
+static lval** lval_canon = NULL;  // open addressing, NULL marks free slots
+static int lval_canon_size = 0;
+static int lval_canon_count = 0;
+
+static unsigned long lval_hash(lval* v);
+
+//same contents, comparing children by identity since they are canonical
+static int lval_canon_eq(lval* x, lval* y)
+{
+    if(x->type != y->type) { return 0;}
+
+    switch(x->type){
+    case LVAL_NUM: return x->num == y->num;
+    case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+    case LVAL_STR: return x->slen == y->slen && memcmp(x->str, y->str, x->slen) == 0;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        if(x->count != y->count) { return 0;}
+        for (int i = 0; i < x->count; i++) {
+            if(x->cell[i] != y->cell[i]) { return 0;}
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void lval_canon_insert(lval* v)
+{
+    int i = v->hash & (lval_canon_size - 1);
+    while(lval_canon[i]) { i = (i + 1) & (lval_canon_size - 1);}
+    lval_canon[i] = v;
+}
+
+//takes 'v' out of the table, moving back the nodes probed past its slot
+static void lval_canon_remove(lval* v)
+{
+    int mask = lval_canon_size - 1;
+    int i = v->hash & mask;
+    while(lval_canon[i] != v) { i = (i + 1) & mask;}
+
+    for (int j = (i + 1) & mask; lval_canon[j]; j = (j + 1) & mask) {
+        int k = lval_canon[j]->hash & mask;
+        if(((j - k) & mask) < ((j - i) & mask)) { continue;}
+        lval_canon[i] = lval_canon[j];
+        i = j;
+    }
+    lval_canon[i] = NULL;
+    lval_canon_count--;
+}
+
+//the canonical node equal to 'v', which is used up
+static lval* lval_intern(lval* v)
+{
+    if(!lval_hashcons || v->rc) { return v;}
+
+    switch(v->type){
+    case LVAL_NUM: case LVAL_SYM: case LVAL_STR: break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        for (int i = 0; i < v->count; i++) {
+            if(!v->cell[i]->interned) { return v;}
+        }
+        break;
+    default: return v;
+    }
+
+    unsigned long h = lval_hash(v);
+    
+    if(lval_canon_size){
+        int i = h & (lval_canon_size - 1);
+        for (; lval_canon[i]; i = (i + 1) & (lval_canon_size - 1)) {
+            if(lval_canon[i]->hash == h && lval_canon_eq(lval_canon[i], v)){
+                lval_del(v);
+                return lval_copy(lval_canon[i]);
+            }
+        }
+    }
+
+    //grow at three quarters full
+    if(4 * (lval_canon_count + 1) > 3 * lval_canon_size){
+        lval** old = lval_canon;
+        int size = lval_canon_size;
+        
+        lval_canon_size = size ? 2 * size : 1024;
+        lval_canon = calloc(lval_canon_size, sizeof(lval*));
+        for (int i = 0; i < size; i++) {
+            if(old[i]) { lval_canon_insert(old[i]);}
+        }
+        free(old);
+    }
+    
+    //one reference is held by the table
+    v->hash = h;
+    v->interned = 1;
+    v->rc = 2;
+    lval_canon_insert(v);
+    lval_canon_count++;
+    return v;
+}
+
+//shares 'v' and everything below it without making them canonical, so a
+//function body and the literals in it are copied in O(1) on every call
+static lval* lval_freeze(lval* v)
+{
+    if(v->rc) { return v;}
+
+    int frozen = 1;
+    switch(v->type){
+    case LVAL_NUM: case LVAL_DBL: case LVAL_BIG: case LVAL_SYM: case LVAL_STR:
+    case LVAL_MAP: case LVAL_MATCH: case LVAL_FUN: break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        for (int i = 0; i < v->count; i++) {
+            v->cell[i] = lval_freeze(v->cell[i]);
+            if(!v->cell[i]->rc) { frozen = 0;}
+        }
+        break;
+    default: frozen = 0;
+    }
+
+    //lists holding something unshared stay unshared themselves
+    if(frozen) { v->rc = 1;}
+    return v;
+}
+
+static lval* lval_read_map(lval* x);
+
 static lval* lval_read(mpc_ast_t* t)
 {
+    if(strstr(t->tag, "double")) { return lval_read_dbl(t);}
     if(strstr(t->tag, "number")) { return lval_read_num(t);}
     if(strstr(t->tag, "symbol")) { return lval_sym(t->contents);}
     if(strstr(t->tag, "string")) { return lval_read_str(t);}
@@ -396,117 +1065,468 @@ static lval* lval_read(mpc_ast_t* t)
     if (strcmp(t->tag, ">") == 0) { x = lval_sexpr();} 
     if (strstr(t->tag, "sexpr")) { x = lval_sexpr();}
     if (strstr(t->tag, "qexpr")) { x = lval_qexpr();}
+    if (strstr(t->tag, "map")) { x = lval_qexpr();}
     
     for(int i = 0; i < t->children_num; i++) {
         assert(x != NULL);
         if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "#{") == 0) { continue; }
         if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
         if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
         if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
         if (strcmp(t->children[i]->tag, "regex") == 0)  { continue; }
         if (strstr(t->children[i]->tag, "comment"))     { continue; }
-        x = lval_add(x, lval_read(t->children[i]));
+        x = lval_add(x, lval_intern(lval_read(t->children[i])));
     }
     
+    if (strstr(t->tag, "map")) { return lval_read_map(x);}
     return x;
 }
 
-static void lval_print(lval* v);
+// Text buffers
+//
+// Printing appends to a growable buffer instead of writing to stdout, so
+// the same code also turns values into strings. String builders hold one
+// too, doubling its capacity keeps appends amortized constant time.
 
-static void lval_expr_print(lval* v, char open, char close)
+static lbuf* lbuf_new(void)
 {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
+    lbuf* b = malloc(sizeof(lbuf));
+    b->refs = 1;
+    b->len = 0;
+    b->cap = 64;
+    b->s = malloc(b->cap);
+    b->s[0] = '\0';
+    return b;
+}
 
-        if(i != (v->count - 1)){
-            putchar(' ');
-        }
-    }
-    putchar(close);
+static void lbuf_del(lbuf* b)
+{
+    if(--b->refs) { return;}
+    free(b->s);
+    free(b);
 }
 
-void lval_print_str(lval* v)
+//room for 'n' more characters and the terminator
+static void lbuf_reserve(lbuf* b, long n)
 {
-    char* escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
-    // Pass it through the escape function
-    escaped = mpcf_escape(escaped);
-    printf("\"%s\"", escaped);
-    free(escaped);
+    if(b->len + n < b->cap) { return;}
+    while(b->len + n >= b->cap) { b->cap *= 2;}
+    b->s = realloc(b->s, b->cap);
 }
 
-static void lval_print(lval* v)
+static void lbuf_add(lbuf* b, const char* s, long n)
 {
-    switch(v->type){
-    case LVAL_NUM: printf("%li", v->num); break;
-    case LVAL_ERR: printf("Error: %s", v->err); break; 
-    case LVAL_SYM: printf("%s", v->sym); break; 
-    case LVAL_STR: lval_print_str(v); break; 
-    case LVAL_FUN: 
-        if(v->builtin){
-        printf("<builtin function>");
-        }else{
-            printf("(\\");lval_print(v->formals); putchar(' '); lval_print(v->body);putchar(')');
-        } break; 
-    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break; 
-    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break; 
-    }
+    lbuf_reserve(b, n);
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
 }
 
-static void lval_println(lval* v) { lval_print(v); putchar('\n');}
+static void lbuf_puts(lbuf* b, const char* s) { lbuf_add(b, s, strlen(s));}
 
-static lval* lval_eval(lenv* e, lval* v);
+static void lbuf_putc(lbuf* b, char c) { lbuf_add(b, &c, 1);}
 
-static lval* lval_eval_sexpr(lenv* e, lval* v) 
+static void lbuf_printf(lbuf* b, const char* fmt, ...)
 {
-    //evaluation children
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]); 
-    }
-
-    //error checking
-    for (int i = 0; i < v->count; i++) {
-        if(v->cell[i]->type == LVAL_ERR) { return lval_take(v,i);} 
-    }
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
 
-    //empty expression
-    if(v->count == 0) { return v;}
+    lbuf_reserve(b, n);
+    va_start(va, fmt);
+    vsnprintf(b->s + b->len, n + 1, fmt, va);
+    va_end(va);
+    b->len += n;
+}
 
-    //single expression, here we assume that functions at least have
-    //an argument.
-    if(v->count == 1){ return lval_take(v, 0);}
+static void lval_write(lbuf* b, lval* v);
+static lval* lvec_get(lvec* v, int i);
 
-    //ensure first element is symbol
-    lval* f = lval_pop(v, 0);
-    if(f->type != LVAL_FUN){
-        lval* err = lval_err("S-Expression starts with incorrect type. First element '%s' is not a function!", 
-                             ltype_name(f->type));
-        lval_del(f); lval_del(v);
-        return err;
-    }
+static void lval_vec_write(lbuf* b, lval* v)
+{
+    lvec* x = v->vec;
     
-    //call a funtion 
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    lbuf_puts(b, "#[");
+    for (int i = 0; i < x->count; i++) {
+        if(i) { lbuf_putc(b, ' ');}
+        if(x->boxed) { lval_write(b, x->items[i]);}
+        else { lbuf_printf(b, "%li", x->nums[i]);}
+    }
+    lbuf_putc(b, ']');
 }
 
-static lval* lval_eval(lenv* e, lval* v)
+//the shortest digits that read back as the same double, with a point so
+//it does not read back as a number
+static void lval_dbl_write(lbuf* b, double x)
 {
-    if(v->type == LVAL_SYM){
-        lval* x = lenv_get(e,v);
-        lval_del(v);
-        return x;
+    char buf[32];
+    for (int p = 1; p <= 17; p++) {
+        snprintf(buf, sizeof(buf), "%.*g", p, x);
+        if(strtod(buf, NULL) == x) { break;}
     }
-
-    if(v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v);}
-    return v;
+    //whole numbers below 1e17 are written out rather than as 4e+01
+    char* exp = strchr(buf, 'e');
+    if(exp && atoi(exp + 1) > 0 && atoi(exp + 1) < 17){
+        snprintf(buf, sizeof(buf), "%.*g", atoi(exp + 1) + 1, x);
+        exp = strchr(buf, 'e');
+    }
+    if(!isfinite(x) || strchr(buf, '.')) { lbuf_puts(b, buf);}
+    else if(exp) { lbuf_printf(b, "%.*s.0%s", (int)(exp - buf), buf, exp);}
+    else { lbuf_printf(b, "%s.0", buf);}
 }
 
-static lval* lval_pop(lval* v, int i)
+static void lval_arr_write(lbuf* b, lval* v)
 {
-    lval* x = v->cell[i];
+    larr* a = v->arr;
+
+    lbuf_puts(b, a->fdata ? "#f64[" : "#i64[");
+    for (long i = 0; i < a->count; i++) {
+        if(i) { lbuf_putc(b, ' ');}
+        if(a->fdata) { lval_dbl_write(b, a->fdata[i]);}
+        else { lbuf_printf(b, "%li", a->data[i]);}
+    }
+    lbuf_putc(b, ']');
+}
+
+static void lval_mat_write(lbuf* b, lval* v)
+{
+    lmat* m = v->mat;
+    
+    lbuf_puts(b, "#mat{");
+    for (long i = 0; i < m->rows; i++) {
+        if(i) { lbuf_putc(b, ' ');}
+        lbuf_putc(b, '{');
+        for (long j = 0; j < m->cols; j++) {
+            if(j) { lbuf_putc(b, ' ');}
+            lbuf_printf(b, "%g", m->data[i * m->cols + j]);
+        }
+        lbuf_putc(b, '}');
+    }
+    lbuf_putc(b, '}');
+}
+
+static void lval_map_write(lbuf* b, lval* v)
+{
+    lmap* m = v->map;
+    int first = 1;
+    
+    lbuf_puts(b, "#{");
+    for (int i = 0; i < m->used; i++) {
+        if(!m->entries[i].key) { continue;}
+        if(!first) { lbuf_putc(b, ' ');}
+        lval_write(b, m->entries[i].key);
+        lbuf_putc(b, ' ');
+        lval_write(b, m->entries[i].val);
+        first = 0;
+    }
+    lbuf_putc(b, '}');
+}
+
+static void lval_expr_write(lbuf* b, lval* v, char open, char close)
+{
+    lbuf_putc(b, open);
+    for (int i = 0; i < v->count; i++) {
+        lval_write(b, v->cell[i]);
+
+        if(i != (v->count - 1)){
+            lbuf_putc(b, ' ');
+        }
+    }
+    lbuf_putc(b, close);
+}
+
+//quoted, with the escapes the reader understands
+static void lval_str_write(lbuf* b, lval* v)
+{
+    static const char from[] = "\a\b\f\n\r\t\v\\\'\"";
+    static const char to[] = "abfnrtv\\\'\"";
+
+    lbuf_putc(b, '"');
+    for (long i = 0; i < v->slen; i++) {
+        char c = v->str[i];
+        const char* e = c ? strchr(from, c) : NULL;
+        if(!c) { lbuf_puts(b, "\\0");}
+        else if(e) { lbuf_putc(b, '\\'); lbuf_putc(b, to[e - from]);}
+        else { lbuf_putc(b, c);}
+    }
+    lbuf_putc(b, '"');
+}
+
+static void lval_write(lbuf* b, lval* v)
+{
+    switch(v->type){
+    case LVAL_NUM: lbuf_printf(b, "%li", v->num); break;
+    case LVAL_DBL: lval_dbl_write(b, v->dbl); break;
+    case LVAL_BIG: lbig_write(b, v->big); break;
+    case LVAL_ERR: lbuf_printf(b, "Error: %s", lerr_text(v)); break; 
+    case LVAL_SYM: lbuf_puts(b, v->sym); break; 
+    case LVAL_STR: lval_str_write(b, v); break; 
+    case LVAL_FUN: 
+        if(v->builtin){
+        lbuf_puts(b, "<builtin function>");
+        }else{
+            lbuf_puts(b, "(\\"); lval_write(b, v->formals); lbuf_putc(b, ' '); lval_write(b, v->body); lbuf_putc(b, ')');
+        } break; 
+    case LVAL_SEXPR: lval_expr_write(b, v, '(', ')'); break; 
+    case LVAL_QEXPR: lval_expr_write(b, v, '{', '}'); break; 
+    case LVAL_SEQ: lbuf_puts(b, "<sequence>"); break;
+    case LVAL_RECUR: lbuf_puts(b, "<recur>"); break;
+    case LVAL_MAP: lval_map_write(b, v); break;
+    case LVAL_VEC: lval_vec_write(b, v); break;
+    case LVAL_ARR: lval_arr_write(b, v); break;
+    case LVAL_MAT: lval_mat_write(b, v); break;
+    case LVAL_BUF: lbuf_printf(b, "<builder of %li>", v->buf->len); break;
+    case LVAL_MATCH: lbuf_printf(b, "<pattern of %i clauses>", v->match->count); break;
+    }
+}
+
+static void lval_print(lval* v)
+{
+    lbuf* b = lbuf_new();
+    lval_write(b, v);
+    fwrite(b->s, 1, b->len, stdout);
+    lbuf_del(b);
+}
+
+static void lval_println(lval* v) { lval_print(v); putchar('\n');}
+
+static lval* lval_eval(lenv* e, lval* v);
+
+// Unwinding
+//
+// Inside 'try' an error jumps straight back to it instead of being handed
+// up through every level in between. The expressions and functions the
+// evaluator is working on are kept on a root stack while it does, and a
+// jump frees those above its unwind point. Builtins keep values of their
+// own across calls back into the evaluator, so errors reach them as values
+// as before and are thrown again further up. The frames functions bind
+// their arguments in are kept on a stack of their own and cleared likewise.
+
+typedef struct lunwind {
+    jmp_buf jmp;
+    int roots;
+    int frames;
+    struct lunwind* prev;
+} lunwind;
+
+static lunwind* lcatch = NULL;
+static lval* lthrown = NULL;
+
+static lval** lroots = NULL;
+static int lroot_count = 0;
+static int lroot_cap = 0;
+
+static lenv** lframes = NULL;
+static int lframe_count = 0;
+static int lframe_cap = 0;
+
+static void lroot_push(lval* v)
+{
+    if(lroot_count == lroot_cap){
+        lroot_cap = lroot_cap ? 2 * lroot_cap : 64;
+        lroots = realloc(lroots, sizeof(lval*) * lroot_cap);
+    }
+    lroots[lroot_count++] = v;
+}
+
+//an expression being evaluated lacks the child that is in flight, the
+//other roots are functions being called
+static void lroot_release(lval* v)
+{
+    if(v->type == LVAL_SEXPR){
+        int n = 0;
+        for (int i = 0; i < v->count; i++) {
+            if(v->cell[i]) { v->cell[n++] = v->cell[i];}
+        }
+        v->count = n;
+    }
+    lval_del(v);
+}
+
+static void lframe_push(lenv* e)
+{
+    if(lframe_count == lframe_cap){
+        lframe_cap = lframe_cap ? 2 * lframe_cap : 64;
+        lframes = realloc(lframes, sizeof(lenv*) * lframe_cap);
+    }
+    lframes[lframe_count++] = e;
+}
+
+static void lval_throw(lval* err)
+{
+    while(lroot_count > lcatch->roots) { lroot_release(lroots[--lroot_count]);}
+    while(lframe_count > lcatch->frames) { lenv_clear(lframes[--lframe_count]);}
+    lthrown = err;
+    longjmp(lcatch->jmp, 1);
+}
+
+// Special forms
+//
+// 'if', 'and' and 'or' are evaluated by the evaluator itself, which only
+// evaluates the arguments it needs: the condition and the branch taken, or
+// the operands up to the first that decides the answer. 'def', '=' and '\'
+// are called directly with their Q-Expressions as written. Handed to other
+// functions they are ordinary builtins of evaluated arguments.
+
+static lval* builtin_logic(lenv* e, lval* a, int any, int lazy);
+static lval* builtin_and(lenv* e, lval* a);
+static lval* builtin_or(lenv* e, lval* a);
+
+static lval* builtin_do(lenv* e, lval* a);
+
+//a 'recur' has to be what a loop body evaluates to, it cannot be used as
+//a value
+static lval* lval_not_recur(lval* x)
+{
+    if(x->type != LVAL_RECUR) { return x;}
+    lval_del(x);
+    return lval_err("Function 'recur' used outside of a tail position!");
+}
+
+//whether child i of 'v' is what 'v' evaluates to
+static int lval_tail(lval* v, int i)
+{
+    if(v->count == 1) { return 1;}
+    return i == v->count - 1 && v->cell[0]->type == LVAL_FUN && v->cell[0]->builtin == builtin_do;
+}
+
+static int lval_form(lbuiltin f)
+{
+    return f == builtin_if || f == builtin_and || f == builtin_or
+        || f == builtin_def || f == builtin_put || f == builtin_lambda;
+}
+
+//evaluates argument i of 'a' in place
+static lval* lval_eval_arg(lenv* e, lval* a, int i)
+{
+    lroot_push(a);
+    lval* x = a->cell[i];
+    a->cell[i] = NULL;
+    a->cell[i] = x = lval_not_recur(lval_eval(e, x));
+    lroot_count--;
+    return x;
+}
+
+static lval* lval_eval_if(lenv* e, lval* a)
+{
+    LASSERT_NUM("if", a, 3);
+    if(lval_eval_arg(e, a, 0)->type == LVAL_ERR) { return lval_take(a, 0);}
+    LASSERT_TYPE("if", a, 0, LVAL_NUM);
+
+    //the branch not taken is never looked at
+    int i = a->cell[0]->num ? 1 : 2;
+    if(a->cell[i]->type != LVAL_QEXPR && lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i);}
+    LASSERT_TYPE("if", a, i, LVAL_QEXPR);
+
+    lval* x = lval_own(lval_take(a, i));
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+}
+
+//'v' is the form with its head evaluated to a special form or a macro
+static lval* lval_eval_form(lenv* e, lval* v)
+{
+    lval* f = lval_pop(v, 0);
+    if(f->macro) { return lmacro_eval(e, f, v);}
+    lbuiltin fn = f->builtin;
+    lval_del(f);
+
+    if(fn == builtin_if) { return lval_eval_if(e, v);}
+    if(fn == builtin_and || fn == builtin_or) { return builtin_logic(e, v, fn == builtin_or, 1);}
+
+    for (int i = 0; i < v->count; i++) {
+        if(v->cell[i]->type == LVAL_QEXPR) { continue;}
+        if(lval_eval_arg(e, v, i)->type == LVAL_ERR) { return lval_take(v, i);}
+    }
+    return fn(e, v);
+}
+
+//true when every operand is, or when any is with 'any' set, evaluating
+//them only up to the one that settles it when 'lazy' is set
+static lval* builtin_logic(lenv* e, lval* a, int any, int lazy)
+{
+    char* func = any ? "or" : "and";
+    for (int i = 0; i < a->count; i++) {
+        if(lazy && lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i);}
+        LASSERT_TYPE(func, a, i, LVAL_NUM);
+        if((a->cell[i]->num != 0) == any){
+            lval_del(a);
+            return lval_num(any);
+        }
+    }
+    lval_del(a);
+    return lval_num(!any);
+}
+
+static lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, 0, 0);}
+static lval* builtin_or(lenv* e, lval* a) { return builtin_logic(e, a, 1, 0);}
+
+static lval* lval_eval_sexpr(lenv* e, lval* v) 
+{
+    //evaluation children, stopping at the first error
+    lroot_push(v);
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        v->cell[i] = NULL;
+        v->cell[i] = x = lval_eval(e, x);
+        if(x->type == LVAL_RECUR && !lval_tail(v, i)) { v->cell[i] = x = lval_not_recur(x);}
+        if(x->type == LVAL_ERR){
+            lroot_count--;
+            if(lcatch) { v->cell[i] = NULL; lroot_release(v); lval_throw(x);}
+            return lval_take(v, i);
+        }
+        if(i == 0 && v->count > 1 && x->type == LVAL_FUN && (x->macro || lval_form(x->builtin))){
+            lroot_count--;
+            return lval_eval_form(e, v);
+        }
+    }
+    lroot_count--;
+
+    //empty expression
+    if(v->count == 0) { return v;}
+
+    //single expression, here we assume that functions at least have
+    //an argument.
+    if(v->count == 1){ return lval_take(v, 0);}
+
+    //ensure first element is symbol
+    lval* f = lval_pop(v, 0);
+    if(f->type != LVAL_FUN){
+        lval* err = lval_err("S-Expression starts with incorrect type. First element '%s' is not a function!", 
+                             ltype_name(f->type));
+        lval_del(f); lval_del(v);
+        return err;
+    }
+    
+    //call a funtion 
+    lroot_push(f);
+    lval* result = lval_call(e, f, v);
+    lroot_count--;
+    lval_del(f);
+    return result;
+}
+
+static lval* lval_map_literal(lval* v);
+
+static lval* lval_eval(lenv* e, lval* v)
+{
+    if(v->type == LVAL_SYM){
+        lval* x = lenv_get(e,v);
+        lval_del(v);
+        return x;
+    }
+
+    if(v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, lval_own(v));}
+    if(v->type == LVAL_MAP && v->literal) { return lval_map_literal(v);}
+    return v;
+}
+
+static lval* lval_pop(lval* v, int i)
+{
+    assert(!v->rc);
+    lval* x = v->cell[i];
     
     //Shift the memory following the item at "i" over the top of it
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
@@ -539,426 +1559,4592 @@ lval* builtin_type_of(lenv* e, lval* a)
 }
    
 
-static lval* builtin_op(lenv* e, lval* a, char* op)
+//operators of the arithmetic and comparison builtins, each builtin
+//passes its own so nothing is looked up by name while running
+enum {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_GT, OP_LT, OP_GE, OP_LE, OP_EQ, OP_NE};
+static char* lop_names[] = {"+", "-", "*", "/", "%", ">", "<", ">=", "<=", "==", "!="};
+
+// Bignums
+//
+// Integers that no longer fit in a long. Magnitudes are arrays of 32 bit
+// limbs, least significant first, with no leading zero limbs. A bignum is
+// never small enough to be a long, results that fit are turned back into
+// numbers, so the two types never hold the same value.
+
+#define LBIG_KARATSUBA 32  // limbs below which schoolbook multiply is faster
+
+static lbig* lbig_new(int count)
 {
-    //ensure all arguments are numbers
-    for (int i = 0; i < a->count; i++) {LASSERT_TYPE(op, a, i, LVAL_NUM);}
+    lbig* b = malloc(sizeof(lbig));
+    b->refs = 1;
+    b->neg = 0;
+    b->count = count;
+    b->d = calloc(count > 0 ? count : 1, sizeof(unsigned));
+    return b;
+}
 
-    //pop the first element
-    lval* x = lval_pop(a, 0);
-    
-    if((strcmp(op, "-") == 0) && a->count == 0) { x->num = -x->num;}
-    
-    while(a->count > 0){
-        lval* y = lval_pop(a, 0);
-        
-        if(strcmp(op, "+") == 0 ) {x->num += y->num;}
-        if(strcmp(op, "-") == 0 ) {x->num -= y->num;}
-        if(strcmp(op, "*") == 0 ) {x->num *= y->num;}
-        if(strcmp(op, "/") == 0 ) {
-            if(y->num == 0){
-                lval_del(x); lval_del(y);
-                //lval_del(a);
-                x = lval_err("Division by Zero!"); break;
-            }else{
-                x->num /= y->num;
+static void lbig_del(lbig* b)
+{
+    if(--b->refs) { return;}
+    free(b->d);
+    free(b);
+}
+
+//drop leading zero limbs
+static lbig* lbig_trim(lbig* b)
+{
+    while(b->count && !b->d[b->count - 1]) { b->count--;}
+    if(!b->count) { b->neg = 0;}
+    return b;
+}
+
+static lbig* lbig_from_long(long x)
+{
+    lbig* b = lbig_new(2);
+    unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    b->neg = x < 0;
+    b->d[0] = m;
+    b->d[1] = m >> 32;
+    return lbig_trim(b);
+}
+
+//the bignum value of a number or bignum, sharing the latter
+static lbig* lbig_of(lval* v)
+{
+    if(v->type == LVAL_NUM) { return lbig_from_long(v->num);}
+    v->big->refs++;
+    return v->big;
+}
+
+static int lbig_to_long(lbig* b, long* x)
+{
+    if(b->count > 2) { return 0;}
+    unsigned long m = b->count ? b->d[0] : 0;
+    if(b->count == 2) { m |= (unsigned long)b->d[1] << 32;}
+    if(m > (unsigned long)LONG_MAX + b->neg) { return 0;}
+    *x = b->neg ? (long)(0 - m) : (long)m;
+    return 1;
+}
+
+static double lbig_to_dbl(lbig* b)
+{
+    double x = 0;
+    for (int i = b->count - 1; i >= 0; i--) { x = x * 4294967296.0 + b->d[i];}
+    return b->neg ? -x : x;
+}
+
+//the result of a bignum operation, which is used up
+static lval* lval_big(lbig* b)
+{
+    long x;
+    if(lbig_to_long(b, &x)) { lbig_del(b); return lval_num(x);}
+
+    lval* v = lval_alloc(LVAL_BIG);
+    v->big = b;
+    return v;
+}
+
+static int lmag_cmp(unsigned* a, int an, unsigned* b, int bn)
+{
+    if(an != bn) { return an < bn ? -1 : 1;}
+    for (int i = an - 1; i >= 0; i--) {
+        if(a[i] != b[i]) { return a[i] < b[i] ? -1 : 1;}
+    }
+    return 0;
+}
+
+//adds 'x' into 'r' starting at limb 'off', carrying as far as needed
+static void lmag_add_at(unsigned* r, int rn, int off, unsigned* x, int xn)
+{
+    unsigned long c = 0;
+    int i = 0;
+    for (; i < xn; i++) {
+        c += (unsigned long)r[off + i] + x[i];
+        r[off + i] = c;
+        c >>= 32;
+    }
+    for (i += off; c && i < rn; i++) {
+        c += r[i];
+        r[i] = c;
+        c >>= 32;
+    }
+}
+
+//subtracts 'x' from 'r' in place, 'r' must be the larger
+static void lmag_sub_in(unsigned* r, int rn, unsigned* x, int xn)
+{
+    long c = 0;
+    for (int i = 0; i < rn && (i < xn || c); i++) {
+        c += (long)r[i] - (i < xn ? x[i] : 0);
+        r[i] = c;
+        c >>= 32;
+    }
+}
+
+static int lmag_len(unsigned* a, int n)
+{
+    while(n && !a[n - 1]) { n--;}
+    return n;
+}
+
+//the product into 'r', which holds an + bn zeroed limbs
+static void lmag_mul(unsigned* r, unsigned* a, int an, unsigned* b, int bn)
+{
+    if(an < bn) { unsigned* t = a; a = b; b = t; int n = an; an = bn; bn = n;}
+    if(!bn) { return;}
+
+    if(bn < LBIG_KARATSUBA){
+        for (int i = 0; i < bn; i++) {
+            unsigned long c = 0;
+            for (int j = 0; j < an; j++) {
+                c += (unsigned long)b[i] * a[j] + r[i + j];
+                r[i + j] = c;
+                c >>= 32;
             }
+            r[i + an] = c;
         }
-        if(strcmp(op, "%") == 0 ) {
-            if(y->num == 0){
-                lval_del(x); lval_del(y);
-                //lval_del(a);
-                x = lval_err("Division by Zero!"); break;
-            }else{
-                x->num %= y->num;
+        return;
+    }
+
+    int m = (an + 1) / 2;
+
+    //too lopsided to split both, multiply by each half of 'a' instead
+    if(bn <= m){
+        lmag_mul(r, a, m, b, bn);
+        unsigned* t = calloc(an - m + bn, sizeof(unsigned));
+        lmag_mul(t, a + m, an - m, b, bn);
+        lmag_add_at(r, an + bn, m, t, an - m + bn);
+        free(t);
+        return;
+    }
+
+    //a = a1 B^m + a0, b = b1 B^m + b0 and
+    //a b = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0
+    unsigned* sa = calloc(m + 1, sizeof(unsigned));
+    unsigned* sb = calloc(m + 1, sizeof(unsigned));
+    memcpy(sa, a, m * sizeof(unsigned));
+    memcpy(sb, b, m * sizeof(unsigned));
+    lmag_add_at(sa, m + 1, 0, a + m, an - m);
+    lmag_add_at(sb, m + 1, 0, b + m, bn - m);
+
+    unsigned* z1 = calloc(2 * m + 2, sizeof(unsigned));
+    lmag_mul(r, a, m, b, m);
+    lmag_mul(r + 2 * m, a + m, an - m, b + m, bn - m);
+    lmag_mul(z1, sa, m + 1, sb, m + 1);
+    lmag_sub_in(z1, 2 * m + 2, r, 2 * m);
+    lmag_sub_in(z1, 2 * m + 2, r + 2 * m, an + bn - 2 * m);
+    lmag_add_at(r, an + bn, m, z1, lmag_len(z1, 2 * m + 2));
+
+    free(sa);
+    free(sb);
+    free(z1);
+}
+
+//quotient into 'q' (an - bn + 1 limbs) and remainder into 'rem' (bn limbs),
+//Knuth's algorithm D, 'b' has no leading zero limbs and an >= bn
+static void lmag_divmod(unsigned* q, unsigned* rem, unsigned* a, int an, unsigned* b, int bn)
+{
+    if(bn == 1){
+        unsigned long r = 0;
+        for (int i = an - 1; i >= 0; i--) {
+            unsigned long t = (r << 32) | a[i];
+            q[i] = t / b[0];
+            r = t % b[0];
+        }
+        rem[0] = r;
+        return;
+    }
+
+    //normalize so the top limb of the divisor has its high bit set
+    int s = __builtin_clz(b[bn - 1]);
+    unsigned* vn = malloc(bn * sizeof(unsigned));
+    unsigned* un = malloc((an + 1) * sizeof(unsigned));
+    for (int i = bn - 1; i > 0; i--) { vn[i] = (b[i] << s) | ((unsigned long)b[i - 1] >> (32 - s));}
+    vn[0] = b[0] << s;
+    un[an] = (unsigned long)a[an - 1] >> (32 - s);
+    for (int i = an - 1; i > 0; i--) { un[i] = (a[i] << s) | ((unsigned long)a[i - 1] >> (32 - s));}
+    un[0] = a[0] << s;
+
+    for (int j = an - bn; j >= 0; j--) {
+        //estimate the quotient limb from the top two limbs, at most one too big
+        unsigned long n = ((unsigned long)un[j + bn] << 32) | un[j + bn - 1];
+        unsigned long qhat = n / vn[bn - 1];
+        unsigned long rhat = n % vn[bn - 1];
+        while(qhat >> 32 || qhat * vn[bn - 2] > ((rhat << 32) | un[j + bn - 2])){
+            qhat--;
+            rhat += vn[bn - 1];
+            if(rhat >> 32) { break;}
+        }
+
+        long k = 0, t;
+        for (int i = 0; i < bn; i++) {
+            unsigned long p = qhat * vn[i];
+            t = un[i + j] - k - (long)(p & 0xFFFFFFFFUL);
+            un[i + j] = t;
+            k = (long)(p >> 32) - (t >> 32);
+        }
+        t = un[j + bn] - k;
+        un[j + bn] = t;
+
+        //subtracted once too often, add it back
+        q[j] = qhat;
+        if(t < 0){
+            q[j]--;
+            unsigned long c = 0;
+            for (int i = 0; i < bn; i++) {
+                c += (unsigned long)un[i + j] + vn[i];
+                un[i + j] = c;
+                c >>= 32;
             }
+            un[j + bn] += c;
         }
+    }
+
+    for (int i = 0; i < bn - 1; i++) { rem[i] = (un[i] >> s) | ((unsigned long)un[i + 1] << (32 - s));}
+    rem[bn - 1] = un[bn - 1] >> s;
+    free(vn);
+    free(un);
+}
 
-        //delete the element now finished with
-        lval_del(y);
+//x + y, or x - y when 'sub' is set
+static lbig* lbig_add(lbig* x, lbig* y, int sub)
+{
+    int yneg = y->neg ^ sub;
+    lbig* r = lbig_new((x->count > y->count ? x->count : y->count) + 1);
+
+    if(x->neg == yneg){
+        memcpy(r->d, x->d, x->count * sizeof(unsigned));
+        lmag_add_at(r->d, r->count, 0, y->d, y->count);
+        r->neg = x->neg;
+    }else if(lmag_cmp(x->d, x->count, y->d, y->count) >= 0){
+        memcpy(r->d, x->d, x->count * sizeof(unsigned));
+        lmag_sub_in(r->d, r->count, y->d, y->count);
+        r->neg = x->neg;
+    }else{
+        memcpy(r->d, y->d, y->count * sizeof(unsigned));
+        lmag_sub_in(r->d, r->count, x->d, x->count);
+        r->neg = yneg;
     }
-    
-    //delete input expression and return result
-    lval_del(a);
-    return x;
+    return lbig_trim(r);
 }
 
-static lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+");}
-static lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-");}
-static lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*");}
-static lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/");}
- 
-static lval* builtin_ord(lenv* e, lval* a, char* op)
+static lbig* lbig_mul(lbig* x, lbig* y)
 {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-    
-    int r;
-    if(strcmp(op, ">") == 0) {r = (a->cell[0]->num > a->cell[1]->num);}
-    if(strcmp(op, "<") == 0) {r = (a->cell[0]->num < a->cell[1]->num);}
-    if(strcmp(op, ">=") == 0) {r = (a->cell[0]->num >= a->cell[1]->num);}
-    if(strcmp(op, "<=") == 0) {r = (a->cell[0]->num <= a->cell[1]->num);}
-    lval_del(a);
-    return lval_num(r);
+    lbig* r = lbig_new(x->count + y->count);
+    lmag_mul(r->d, x->d, x->count, y->d, y->count);
+    r->neg = x->neg ^ y->neg;
+    return lbig_trim(r);
 }
 
-lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">");}
-lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<");}
-lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">=");}
-lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<=");}
- 
-int lval_eq(lval* x, lval* y)
+//quotient truncated toward zero, or the remainder with the sign of 'x'
+//when 'mod' is set, like C does for longs
+static lbig* lbig_div(lbig* x, lbig* y, int mod)
 {
-    if(x->type != y->type) {return 0;}
-    
-    switch(x->type){
-    case LVAL_NUM: return (x->num == y->num);
-    case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    if(lmag_cmp(x->d, x->count, y->d, y->count) < 0){
+        if(!mod) { return lbig_new(0);}
+        x->refs++;
+        return x;
+    }
 
-    case LVAL_FUN: 
-        if(x->builtin)
-            return x->builtin == y->builtin;
-        else
-            return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-        if(x->count != y->count)
-            return 0;
-        for (int i = 0; i < x->count; i++) {
-            if(!lval_eq(x->cell[i], y->cell[i])) 
-                return 0;
+    lbig* q = lbig_new(x->count - y->count + 1);
+    lbig* r = lbig_new(y->count);
+    lmag_divmod(q->d, r->d, x->d, x->count, y->d, y->count);
+    q->neg = x->neg ^ y->neg;
+    r->neg = x->neg;
+
+    lbig_del(mod ? q : r);
+    return lbig_trim(mod ? r : q);
+}
+
+static int lbig_cmp(lbig* x, lbig* y)
+{
+    if(x->neg != y->neg) { return x->neg ? -1 : 1;}
+    int c = lmag_cmp(x->d, x->count, y->d, y->count);
+    return x->neg ? -c : c;
+}
+
+//reads decimal digits with an optional sign
+static lbig* lbig_read(char* s)
+{
+    int neg = *s == '-';
+    if(neg) { s++;}
+
+    //nine digits at a time, each chunk fits in a limb
+    lbig* b = lbig_new(strlen(s) / 9 + 2);
+    while(*s){
+        unsigned long c = 0, scale = 1;
+        for (int i = 0; i < 9 && *s; i++, s++) {
+            c = c * 10 + (*s - '0');
+            scale *= 10;
         }
-        return 1;
-        break;
+        for (int i = 0; i < b->count; i++) {
+            c += b->d[i] * scale;
+            b->d[i] = c;
+            c >>= 32;
+        }
+    }
+    b->neg = neg;
+    return lbig_trim(b);
+}
+
+static void lbig_write(lbuf* out, lbig* b)
+{
+    //peel off nine digits at a time, least significant first
+    unsigned* n = malloc((b->count ? b->count : 1) * sizeof(unsigned));
+    unsigned* q = malloc((b->count ? b->count : 1) * sizeof(unsigned));
+    unsigned* chunks = malloc((b->count * 10 / 9 + 2) * sizeof(unsigned));
+    unsigned billion = 1000000000;
+    int len = b->count;
+    int count = 0;
+
+    memcpy(n, b->d, len * sizeof(unsigned));
+    while(len){
+        lmag_divmod(q, &chunks[count++], n, len, &billion, 1);
+        len = lmag_len(q, len);
+        unsigned* t = n; n = q; q = t;
+    }
+
+    if(b->neg) { lbuf_putc(out, '-');}
+    lbuf_printf(out, "%u", count ? chunks[count - 1] : 0);
+    for (int i = count - 2; i >= 0; i--) { lbuf_printf(out, "%09u", chunks[i]);}
+
+    free(n);
+    free(q);
+    free(chunks);
+}
+
+//finishes the operation once it left the range of a long, 'x' is the
+//result so far and the arguments from 'i' on are still to come
+static lval* builtin_op_big(lenv* e, lval* a, int op, lbig* x, int i)
+{
+    if(op == OP_SUB && a->count == 1) {
+        lbig* zero = lbig_new(0);
+        lbig* r = lbig_add(zero, x, 1);
+        lbig_del(zero);
+        lbig_del(x);
+        x = r;
+    }
+
+    for (; i < a->count; i++) {
+        lbig* y = lbig_of(a->cell[i]);
+        lbig* r = NULL;
+
+        switch(op){
+        case OP_ADD: r = lbig_add(x, y, 0); break;
+        case OP_SUB: r = lbig_add(x, y, 1); break;
+        case OP_MUL: r = lbig_mul(x, y); break;
+        case OP_DIV:
+        case OP_MOD:
+            if(!y->count){
+                lbig_del(x); lbig_del(y);
+                lval_del(a);
+                return lval_err_const(LERR_DIVZERO);
+            }
+            r = lbig_div(x, y, op == OP_MOD);
+            break;
+        }
+
+        lbig_del(x);
+        lbig_del(y);
+        x = r;
+    }
+
+    lval_del(a);
+    return lval_big(x);
+}
+
+//the numeric value of a number, double or bignum
+static double lval_to_dbl(lval* v)
+{
+    if(v->type == LVAL_BIG) { return lbig_to_dbl(v->big);}
+    return v->type == LVAL_DBL ? v->dbl : v->num;
+}
+
+//arithmetic once any argument is a double, everything is promoted and
+//accumulated in a plain double until the result is boxed at the end
+static lval* builtin_op_dbl(lenv* e, lval* a, int op)
+{
+    double x = lval_to_dbl(a->cell[0]);
+
+    if(op == OP_SUB && a->count == 1) { x = -x;}
+
+    for (int i = 1; i < a->count; i++) {
+        double y = lval_to_dbl(a->cell[i]);
+
+        switch(op){
+        case OP_ADD: x += y; break;
+        case OP_SUB: x -= y; break;
+        case OP_MUL: x *= y; break;
+        case OP_DIV:
+        case OP_MOD:
+            if(y == 0){
+                lval_del(a);
+                return lval_err_const(LERR_DIVZERO);
+            }
+            x = op == OP_DIV ? x / y : fmod(x, y);
+            break;
+        }
+    }
+
+    lval_del(a);
+    return lval_dbl(x);
+}
+
+//inlined into each arithmetic builtin, so the switches on 'op' fold away
+//and every builtin gets its own loop over the unboxed arguments
+__attribute__((always_inline))
+static inline lval* builtin_op(lenv* e, lval* a, int op)
+{
+    //ensure all arguments are numbers
+    int dbl = 0, big = 0;
+    for (int i = 0; i < a->count; i++) {
+        if(a->cell[i]->type == LVAL_DBL) { dbl = 1; continue;}
+        if(a->cell[i]->type == LVAL_BIG) { big = 1; continue;}
+        LASSERT_TYPE(lop_names[op], a, i, LVAL_NUM);
+    }
+    if(dbl) { return builtin_op_dbl(e, a, op);}
+    if(big) { return builtin_op_big(e, a, op, lbig_of(a->cell[0]), 1);}
+
+    long x = a->cell[0]->num;
+    
+    if(op == OP_SUB && a->count == 1) {
+        if(x == LONG_MIN) { return builtin_op_big(e, a, op, lbig_of(a->cell[0]), 1);}
+        x = -x;
+    }
+    
+    for (int i = 1; i < a->count; i++) {
+        long y = a->cell[i]->num;
+        long r = 0;
+        int over = 0;
+        
+        switch(op){
+        case OP_ADD: over = __builtin_add_overflow(x, y, &r); break;
+        case OP_SUB: over = __builtin_sub_overflow(x, y, &r); break;
+        case OP_MUL: over = __builtin_mul_overflow(x, y, &r); break;
+        case OP_DIV:
+        case OP_MOD:
+            if(y == 0){
+                lval_del(a);
+                return lval_err_const(LERR_DIVZERO);
+            }
+            over = x == LONG_MIN && y == -1;
+            if(over) { r = 0;}
+            else { r = op == OP_DIV ? x / y : x % y;}
+            //LONG_MIN % -1 is 0 but traps in hardware
+            if(op == OP_MOD) { over = 0;}
+            break;
+        }
+
+        //carry on in arbitrary precision from the operation that overflowed
+        if(over) { return builtin_op_big(e, a, op, lbig_from_long(x), i);}
+        x = r;
+    }
+    
+    lval_del(a);
+    return lval_num(x);
+}
+
+static lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, OP_ADD);}
+static lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, OP_SUB);}
+static lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, OP_MUL);}
+static lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, OP_DIV);}
+static lval* builtin_mod(lenv* e, lval* a) { return builtin_op(e, a, OP_MOD);}
+ 
+__attribute__((always_inline))
+static inline lval* builtin_ord(lenv* e, lval* a, int op)
+{
+    LASSERT_NUM(lop_names[op], a, 2);
+    for (int i = 0; i < 2; i++) {
+        int t = a->cell[i]->type;
+        if(t != LVAL_DBL && t != LVAL_BIG) { LASSERT_TYPE(lop_names[op], a, i, LVAL_NUM);}
+    }
+    
+    int r = 0;
+    if(a->cell[0]->type == LVAL_DBL || a->cell[1]->type == LVAL_DBL){
+        double x = lval_to_dbl(a->cell[0]);
+        double y = lval_to_dbl(a->cell[1]);
+        switch(op){
+        case OP_GT: r = (x > y); break;
+        case OP_LT: r = (x < y); break;
+        case OP_GE: r = (x >= y); break;
+        case OP_LE: r = (x <= y); break;
+        }
+    }else{
+        long x = a->cell[0]->num;
+        long y = a->cell[1]->num;
+        //bignums are ordered like their comparison result is against 0
+        if(a->cell[0]->type == LVAL_BIG || a->cell[1]->type == LVAL_BIG){
+            lbig* bx = lbig_of(a->cell[0]);
+            lbig* by = lbig_of(a->cell[1]);
+            x = lbig_cmp(bx, by);
+            y = 0;
+            lbig_del(bx);
+            lbig_del(by);
+        }
+        switch(op){
+        case OP_GT: r = (x > y); break;
+        case OP_LT: r = (x < y); break;
+        case OP_GE: r = (x >= y); break;
+        case OP_LE: r = (x <= y); break;
+        }
+    }
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, OP_GT);}
+lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, OP_LT);}
+lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, OP_GE);}
+lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, OP_LE);}
+ 
+int lval_eq(lval* x, lval* y)
+{
+    if(x == y) {return 1;}
+    if(x->type != y->type) {return 0;}
+    if(x->interned && y->interned) {return 0;}
+    
+    switch(x->type){
+    case LVAL_NUM: return (x->num == y->num);
+    case LVAL_DBL: return (x->dbl == y->dbl);
+    case LVAL_BIG: return lbig_cmp(x->big, y->big) == 0;
+    case LVAL_ERR: return (strcmp(lerr_text(x), lerr_text(y)) == 0);
+    case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
+    case LVAL_STR: return x->slen == y->slen && memcmp(x->str, y->str, x->slen) == 0;
+
+    case LVAL_FUN: 
+        if(x->builtin)
+            return x->builtin == y->builtin;
+        else
+            return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        if(x->count != y->count)
+            return 0;
+        for (int i = 0; i < x->count; i++) {
+            if(!lval_eq(x->cell[i], y->cell[i])) 
+                return 0;
+        }
+        return 1;
+        break;
+    case LVAL_SEQ: return x->seq == y->seq;
+    case LVAL_BUF: return x->buf == y->buf;
+    case LVAL_MATCH: return x->match == y->match;
+    case LVAL_MAP:
+        if(x->map->count != y->map->count) { return 0;}
+        for (int i = 0; i < x->map->used; i++) {
+            lmap_entry* n = &x->map->entries[i];
+            if(!n->key) { continue;}
+            lval* v = lmap_get(y->map, n->key);
+            if(!v || !lval_eq(n->val, v)) { return 0;}
+        }
+        return 1;
+    case LVAL_VEC:
+        if(x->vec->count != y->vec->count) { return 0;}
+        for (int i = 0; i < x->vec->count; i++) {
+            lval* a = lvec_get(x->vec, i);
+            lval* b = lvec_get(y->vec, i);
+            int eq = lval_eq(a, b);
+            lval_del(a); lval_del(b);
+            if(!eq) { return 0;}
+        }
+        return 1;
+    case LVAL_ARR:
+        if(x->arr->count != y->arr->count || !x->arr->fdata != !y->arr->fdata) { return 0;}
+        if(!x->arr->fdata){
+            return memcmp(x->arr->data, y->arr->data, sizeof(long) * x->arr->count) == 0;
+        }
+        for (long i = 0; i < x->arr->count; i++) {
+            if(x->arr->fdata[i] != y->arr->fdata[i]) { return 0;}
+        }
+        return 1;
+    case LVAL_MAT:
+        if(x->mat->rows != y->mat->rows || x->mat->cols != y->mat->cols) { return 0;}
+        for (long i = 0; i < x->mat->rows * x->mat->cols; i++) {
+            if(x->mat->data[i] != y->mat->data[i]) { return 0;}
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned long lhash_step(unsigned long h, unsigned long x)
+{
+    h = (h ^ x) * 1099511628211UL;
+    return h ^ (h >> 29);
+}
+
+static unsigned long lhash_mem(unsigned long h, const char* s, long n)
+{
+    for (long i = 0; i < n; i++) { h = (h ^ (unsigned char)s[i]) * 1099511628211UL;}
+    return lhash_step(h, 0);
+}
+
+static unsigned long lhash_str(unsigned long h, char* s) { return lhash_mem(h, s, strlen(s));}
+
+static unsigned long lhash_dbl(unsigned long h, double d)
+{
+    //-0.0 equals 0.0 so both hash the same
+    if(d == 0) { d = 0;}
+    unsigned long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return lhash_step(h, bits);
+}
+
+//structural hash, equal under lval_eq means equal hash
+static unsigned long lval_hash(lval* v)
+{
+    if(v->interned) { return v->hash;}
+
+    unsigned long h = lhash_step(14695981039346656037UL, v->type);
+
+    switch(v->type){
+    case LVAL_NUM: return lhash_step(h, v->num);
+    case LVAL_DBL: return lhash_dbl(h, v->dbl);
+    case LVAL_BIG:
+        for (int i = 0; i < v->big->count; i++) { h = lhash_step(h, v->big->d[i]);}
+        return lhash_step(h, v->big->neg);
+    case LVAL_ERR: return lhash_str(h, lerr_text(v));
+    case LVAL_SYM: return lhash_str(h, v->sym);
+    case LVAL_STR: return lhash_mem(h, v->str, v->slen);
+
+    case LVAL_FUN: 
+        if(v->builtin)
+            return lhash_step(h, (unsigned long)v->builtin);
+        else
+            return lhash_step(lval_hash(v->formals), lval_hash(v->body));
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+        for (int i = 0; i < v->count; i++) {
+            h = lhash_step(h, lval_hash(v->cell[i]));
+        }
+        return h;
+    case LVAL_SEQ: return lhash_step(h, (unsigned long)v->seq);
+    case LVAL_BUF: return lhash_step(h, (unsigned long)v->buf);
+    case LVAL_MATCH: return lhash_step(h, (unsigned long)v->match);
+    case LVAL_MAP: {
+        //entries are summed so the order they were added in does not matter
+        unsigned long sum = 0;
+        for (int i = 0; i < v->map->used; i++) {
+            lmap_entry* n = &v->map->entries[i];
+            if(n->key) { sum += lhash_step(n->hash, lval_hash(n->val));}
+        }
+        return lhash_step(h, sum);
+    }
+    case LVAL_VEC:
+        for (int i = 0; i < v->vec->count; i++) {
+            if(v->vec->boxed){
+                h = lhash_step(h, lval_hash(v->vec->items[i]));
+            }else{
+                lval n = {.type = LVAL_NUM, .num = v->vec->nums[i]};
+                h = lhash_step(h, lval_hash(&n));
+            }
+        }
+        return h;
+    case LVAL_ARR:
+        for (long i = 0; i < v->arr->count; i++) {
+            h = v->arr->fdata ? lhash_dbl(h, v->arr->fdata[i]) : lhash_step(h, v->arr->data[i]);
+        }
+        return h;
+    case LVAL_MAT:
+        h = lhash_step(h, v->mat->rows);
+        for (long i = 0; i < v->mat->rows * v->mat->cols; i++) {
+            h = lhash_dbl(h, v->mat->data[i]);
+        }
+        return h;
+    }
+    return h;
+}
+
+// Maps
+//
+// Keys are compared with lval_eq under their structural hash. A map is
+// shared by every copy of it and changed in place by map-put and map-del,
+// except for literals in the source, which build a new map each time they
+// are evaluated.
+
+#define MAP_EMPTY -1
+#define MAP_DELETED -2
+
+static lmap* lmap_new(void)
+{
+    lmap* m = malloc(sizeof(lmap));
+    m->refs = 1;
+    m->count = 0;
+    m->used = 0;
+    m->cap = 0;
+    m->size = 8;
+    m->index = malloc(sizeof(int) * m->size);
+    m->entries = NULL;
+    for (int i = 0; i < m->size; i++) { m->index[i] = MAP_EMPTY;}
+    return m;
+}
+
+static void lmap_del(lmap* m)
+{
+    if(--m->refs) { return;}
+
+    for (int i = 0; i < m->used; i++) {
+        if(m->entries[i].key){
+            lval_del(m->entries[i].key);
+            lval_del(m->entries[i].val);
+        }
+    }
+    free(m->index);
+    free(m->entries);
+    free(m);
+}
+
+//slot holding 'k', or the empty slot it would go in
+static int lmap_find(lmap* m, lval* k, unsigned long hash)
+{
+    int mask = m->size - 1;
+    for (int i = hash & mask;; i = (i + 1) & mask) {
+        int j = m->index[i];
+        if(j == MAP_EMPTY) { return i;}
+        if(j != MAP_DELETED && m->entries[j].hash == hash && lval_eq(m->entries[j].key, k)) { return i;}
+    }
+}
+
+//drop deleted entries and index the rest in 'size' slots
+static void lmap_rebuild(lmap* m, int size)
+{
+    int n = 0;
+    for (int i = 0; i < m->used; i++) {
+        if(m->entries[i].key) { m->entries[n++] = m->entries[i];}
+    }
+    m->used = n;
+
+    free(m->index);
+    m->size = size;
+    m->index = malloc(sizeof(int) * size);
+    for (int i = 0; i < size; i++) { m->index[i] = MAP_EMPTY;}
+    
+    for (int j = 0; j < n; j++) {
+        int i = m->entries[j].hash & (size - 1);
+        while(m->index[i] != MAP_EMPTY) { i = (i + 1) & (size - 1);}
+        m->index[i] = j;
+    }
+}
+
+static lval* lmap_get(lmap* m, lval* k)
+{
+    int i = lmap_find(m, k, lval_hash(k));
+    return m->index[i] == MAP_EMPTY ? NULL : m->entries[m->index[i]].val;
+}
+
+//bind 'k' to 'v', both are used up
+static void lmap_put(lmap* m, lval* k, lval* v)
+{
+    unsigned long hash = lval_hash(k);
+    int i = lmap_find(m, k, hash);
+
+    if(m->index[i] != MAP_EMPTY){
+        lmap_entry* n = &m->entries[m->index[i]];
+        lval_del(n->val);
+        n->val = v;
+        lval_del(k);
+        return;
+    }
+
+    //slots of deleted entries count until the next rebuild, keep a third free
+    if(3 * (m->used + 1) > 2 * m->size){
+        int size = m->size;
+        while(3 * (m->count + 1) > 2 * size) { size *= 2;}
+        lmap_rebuild(m, size);
+        i = lmap_find(m, k, hash);
+    }
+    
+    if(m->used == m->cap){
+        m->cap = m->cap ? 2 * m->cap : 8;
+        m->entries = realloc(m->entries, sizeof(lmap_entry) * m->cap);
+    }
+    
+    m->entries[m->used].key = k;
+    m->entries[m->used].val = v;
+    m->entries[m->used].hash = hash;
+    m->index[i] = m->used++;
+    m->count++;
+}
+
+static void lmap_remove(lmap* m, lval* k)
+{
+    int i = lmap_find(m, k, lval_hash(k));
+    if(m->index[i] == MAP_EMPTY) { return;}
+
+    lmap_entry* n = &m->entries[m->index[i]];
+    lval_del(n->key);
+    lval_del(n->val);
+    n->key = NULL;
+    m->index[i] = MAP_DELETED;
+    m->count--;
+}
+
+static lval* lval_map(lmap* m)
+{
+    lval* v = lval_alloc(LVAL_MAP);
+    v->map = m;
+    v->literal = 0;
+    return v;
+}
+
+static lval* lval_map_literal(lval* v)
+{
+    lmap* m = lmap_new();
+    for (int i = 0; i < v->map->used; i++) {
+        lmap_entry* n = &v->map->entries[i];
+        if(n->key) { lmap_put(m, lval_copy(n->key), lval_copy(n->val));}
+    }
+    lval_del(v);
+    return lval_map(m);
+}
+
+//build the map of a literal from its keys and values in turn
+static lval* lval_read_map(lval* x)
+{
+    if(x->count % 2){
+        lval_del(x);
+        return lval_err("Map literal passed key without value!");
+    }
+
+    lval* v = lval_map(lmap_new());
+    v->literal = 1;
+    while(x->count) {
+        lval* k = lval_pop(x, 0);
+        lmap_put(v->map, k, lval_pop(x, 0));
+    }
+    lval_del(x);
+    return v;
+}
+
+static lval* builtin_map_new(lenv* e, lval* a)
+{
+    LASSERT_NUM("map-new", a, 1);
+    LASSERT_TYPE("map-new", a, 0, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    for (int i = 0; i < l->count; i++) {
+        LASSERT(a, (l->cell[i]->type == LVAL_QEXPR && l->cell[i]->count == 2),
+                "Function 'map-new' passed incorrect element %i. Got %s, Expected pair.",
+                i, ltype_name(l->cell[i]->type));
+    }
+
+    lmap* m = lmap_new();
+    for (int i = 0; i < l->count; i++) {
+        lmap_put(m, lval_copy(l->cell[i]->cell[0]), lval_copy(l->cell[i]->cell[1]));
+    }
+    
+    lval_del(a);
+    return lval_map(m);
+}
+
+static lval* builtin_map_get(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count == 2 || a->count == 3),
+            "Function 'map-get' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("map-get", a, 0, LVAL_MAP);
+
+    lval* v = lmap_get(a->cell[0]->map, a->cell[1]);
+    LASSERT(a, (v || a->count == 3), "No Element Found");
+
+    v = v ? lval_copy(v) : lval_pop(a, 2);
+    lval_del(a);
+    return v;
+}
+
+static lval* builtin_map_put(lenv* e, lval* a)
+{
+    LASSERT_NUM("map-put", a, 3);
+    LASSERT_TYPE("map-put", a, 0, LVAL_MAP);
+
+    lval* m = lval_pop(a, 0);
+    lval* k = lval_pop(a, 0);
+    lmap_put(m->map, k, lval_pop(a, 0));
+    
+    lval_del(a);
+    return m;
+}
+
+static lval* builtin_map_del(lenv* e, lval* a)
+{
+    LASSERT_NUM("map-del", a, 2);
+    LASSERT_TYPE("map-del", a, 0, LVAL_MAP);
+
+    lval* m = lval_pop(a, 0);
+    lmap_remove(m->map, a->cell[0]);
+    
+    lval_del(a);
+    return m;
+}
+
+static lval* builtin_map_keys(lenv* e, lval* a)
+{
+    LASSERT_NUM("map-keys", a, 1);
+    LASSERT_TYPE("map-keys", a, 0, LVAL_MAP);
+
+    lmap* m = a->cell[0]->map;
+    lval* x = lval_qexpr();
+    for (int i = 0; i < m->used; i++) {
+        if(m->entries[i].key) { lval_add(x, lval_copy(m->entries[i].key));}
+    }
+    
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_map_count(lenv* e, lval* a)
+{
+    LASSERT_NUM("map-count", a, 1);
+    LASSERT_TYPE("map-count", a, 0, LVAL_MAP);
+
+    lval* x = lval_num(a->cell[0]->map->count);
+    lval_del(a);
+    return x;
+}
+
+// Vectors
+//
+// Contiguous arrays indexed in constant time. Like maps they are changed
+// in place by vec-set! and vec-push and seen by every copy.
+
+static lvec* lvec_new(int cap)
+{
+    lvec* v = malloc(sizeof(lvec));
+    v->refs = 1;
+    v->count = 0;
+    v->cap = cap;
+    v->boxed = 0;
+    v->nums = malloc(sizeof(long) * (cap ? cap : 1));
+    v->items = NULL;
+    return v;
+}
+
+static void lvec_del(lvec* v)
+{
+    if(--v->refs) { return;}
+
+    if(v->boxed){
+        for (int i = 0; i < v->count; i++) { lval_del(v->items[i]);}
+        free(v->items);
+    }
+    free(v->nums);
+    free(v);
+}
+
+//store every element as an lval from now on
+static void lvec_box(lvec* v)
+{
+    v->items = malloc(sizeof(lval*) * (v->cap ? v->cap : 1));
+    for (int i = 0; i < v->count; i++) { v->items[i] = lval_num(v->nums[i]);}
+    free(v->nums);
+    v->nums = NULL;
+    v->boxed = 1;
+}
+
+//element 'i' as a new value
+static lval* lvec_get(lvec* v, int i)
+{
+    return v->boxed ? lval_copy(v->items[i]) : lval_num(v->nums[i]);
+}
+
+//store 'x' at 'i', which is used up
+static void lvec_set(lvec* v, int i, lval* x)
+{
+    if(!v->boxed && x->type != LVAL_NUM) { lvec_box(v);}
+
+    if(v->boxed){
+        if(i < v->count) { lval_del(v->items[i]);}
+        v->items[i] = x;
+    }else{
+        v->nums[i] = x->num;
+        lval_del(x);
+    }
+}
+
+static void lvec_push(lvec* v, lval* x)
+{
+    if(v->count == v->cap){
+        v->cap = v->cap ? 2 * v->cap : 8;
+        if(v->boxed) { v->items = realloc(v->items, sizeof(lval*) * v->cap);}
+        else { v->nums = realloc(v->nums, sizeof(long) * v->cap);}
+    }
+    //the new slot holds nothing to free yet
+    lvec_set(v, v->count, x);
+    v->count++;
+}
+
+static lval* lval_vec(lvec* v)
+{
+    lval* x = lval_alloc(LVAL_VEC);
+    x->vec = v;
+    return x;
+}
+
+//vector of the elements of the Q-Expression 'q', which is used up
+static lval* lval_list_vec(lval* q)
+{
+    lvec* v = lvec_new(q->count);
+    for (int i = 0; i < q->count; i++) { lvec_push(v, lval_copy(q->cell[i]));}
+    lval_del(q);
+    return lval_vec(v);
+}
+
+static lval* builtin_vec(lenv* e, lval* a)
+{
+    a->type = LVAL_QEXPR;
+    return lval_list_vec(a);
+}
+
+static lval* builtin_list_vec(lenv* e, lval* a)
+{
+    LASSERT_NUM("list->vec", a, 1);
+    LASSERT_TYPE("list->vec", a, 0, LVAL_QEXPR);
+    return lval_list_vec(lval_take(a, 0));
+}
+
+static lval* builtin_vec_list(lenv* e, lval* a)
+{
+    LASSERT_NUM("vec->list", a, 1);
+    LASSERT_TYPE("vec->list", a, 0, LVAL_VEC);
+
+    lvec* v = a->cell[0]->vec;
+    lval* x = lval_qexpr();
+    for (int i = 0; i < v->count; i++) { lval_add(x, lvec_get(v, i));}
+
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_vec_ref(lenv* e, lval* a)
+{
+    LASSERT_NUM("vec-ref", a, 2);
+    LASSERT_TYPE("vec-ref", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-ref", a, 1, LVAL_NUM);
+
+    lvec* v = a->cell[0]->vec;
+    long i = a->cell[1]->num;
+    LASSERT_INDEX("vec-ref", a, v, i, 0);
+
+    lval* x = lvec_get(v, i);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_vec_set(lenv* e, lval* a)
+{
+    LASSERT_NUM("vec-set!", a, 3);
+    LASSERT_TYPE("vec-set!", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-set!", a, 1, LVAL_NUM);
+
+    lvec* v = a->cell[0]->vec;
+    long i = a->cell[1]->num;
+    LASSERT_INDEX("vec-set!", a, v, i, 0);
+
+    lvec_set(v, i, lval_pop(a, 2));
+    return lval_take(a, 0);
+}
+
+static lval* builtin_vec_push(lenv* e, lval* a)
+{
+    LASSERT_NUM("vec-push", a, 2);
+    LASSERT_TYPE("vec-push", a, 0, LVAL_VEC);
+
+    lvec_push(a->cell[0]->vec, lval_pop(a, 1));
+    return lval_take(a, 0);
+}
+
+static lval* builtin_vec_len(lenv* e, lval* a)
+{
+    LASSERT_NUM("vec-len", a, 1);
+    LASSERT_TYPE("vec-len", a, 0, LVAL_VEC);
+
+    lval* x = lval_num(a->cell[0]->vec->count);
+    lval_del(a);
+    return x;
+}
+
+//new vector of the elements from 'start' up to 'end'
+static lval* builtin_vec_slice(lenv* e, lval* a)
+{
+    LASSERT_NUM("vec-slice", a, 3);
+    LASSERT_TYPE("vec-slice", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-slice", a, 1, LVAL_NUM);
+    LASSERT_TYPE("vec-slice", a, 2, LVAL_NUM);
+
+    lvec* v = a->cell[0]->vec;
+    long start = a->cell[1]->num;
+    long end = a->cell[2]->num;
+    LASSERT_INDEX("vec-slice", a, v, start, 1);
+    LASSERT_INDEX("vec-slice", a, v, end, 1);
+    LASSERT(a, (start <= end), "Function 'vec-slice' passed start %li after end %li!", start, end);
+
+    lvec* x = lvec_new(end - start);
+    if(v->boxed){
+        for (long i = start; i < end; i++) { lvec_push(x, lval_copy(v->items[i]));}
+    }else{
+        memcpy(x->nums, v->nums + start, sizeof(long) * (end - start));
+        x->count = end - start;
+    }
+
+    lval_del(a);
+    return lval_vec(x);
+}
+
+// Typed arrays
+//
+// Arrays of int64 or of doubles stored unboxed. Reductions and elementwise
+// operations run as native kernels, using AVX2 or SSE2 when the processor
+// has them and plain loops otherwise. Integer arithmetic wraps around like
+// the hardware, double sums are added up in several lanes at once.
+
+enum {ARR_ADD, ARR_SUB, ARR_MUL, ARR_DIV, ARR_LT, ARR_GT, ARR_EQ};
+
+static larr* larr_new(long count)
+{
+    larr* a = malloc(sizeof(larr));
+    a->refs = 1;
+    a->count = count;
+    a->data = malloc(sizeof(long) * (count > 0 ? count : 1));
+    a->fdata = NULL;
+    return a;
+}
+
+static larr* larr_new_f64(long count)
+{
+    larr* a = malloc(sizeof(larr));
+    a->refs = 1;
+    a->count = count;
+    a->data = NULL;
+    a->fdata = malloc(sizeof(double) * (count > 0 ? count : 1));
+    return a;
+}
+
+static void larr_del(larr* a)
+{
+    if(--a->refs) { return;}
+    free(a->data);
+    free(a->fdata);
+    free(a);
+}
+
+//the array itself if it holds doubles, a converted copy otherwise
+static larr* larr_f64(larr* a)
+{
+    if(a->fdata) { a->refs++; return a;}
+
+    larr* r = larr_new_f64(a->count);
+    for (long i = 0; i < a->count; i++) { r->fdata[i] = a->data[i];}
+    return r;
+}
+
+static lval* lval_arr(larr* a)
+{
+    lval* v = lval_alloc(LVAL_ARR);
+    v->arr = a;
+    return v;
+}
+
+//0 for plain loops, 1 for SSE2, 2 for AVX2
+static int larr_level(void)
+{
+    static int level = -1;
+    if(level < 0){
+#ifdef LARR_SIMD
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? 2 : 1;
+#else
+        level = 0;
+#endif
+    }
+    return level;
+}
+
+static void larr_scalar(int op, long* r, long* x, long* y, long n)
+{
+    unsigned long* u = (unsigned long*)x;
+    unsigned long* v = (unsigned long*)y;
+
+    switch(op){
+    case ARR_ADD: for (long i = 0; i < n; i++) { r[i] = u[i] + v[i];} break;
+    case ARR_SUB: for (long i = 0; i < n; i++) { r[i] = u[i] - v[i];} break;
+    case ARR_MUL: for (long i = 0; i < n; i++) { r[i] = u[i] * v[i];} break;
+    case ARR_DIV:
+        //dividing by -1 negates, which wraps for the smallest long
+        for (long i = 0; i < n; i++) { r[i] = y[i] == -1 ? (long)(0 - u[i]) : x[i] / y[i];}
+        break;
+    case ARR_LT: for (long i = 0; i < n; i++) { r[i] = x[i] < y[i];} break;
+    case ARR_GT: for (long i = 0; i < n; i++) { r[i] = x[i] > y[i];} break;
+    case ARR_EQ: for (long i = 0; i < n; i++) { r[i] = x[i] == y[i];} break;
+    }
+}
+
+//doubles into 'f', or comparison masks into 'm'
+static void larr_fscalar(int op, double* f, long* m, double* x, double* y, long n)
+{
+    switch(op){
+    case ARR_ADD: for (long i = 0; i < n; i++) { f[i] = x[i] + y[i];} break;
+    case ARR_SUB: for (long i = 0; i < n; i++) { f[i] = x[i] - y[i];} break;
+    case ARR_MUL: for (long i = 0; i < n; i++) { f[i] = x[i] * y[i];} break;
+    case ARR_DIV: for (long i = 0; i < n; i++) { f[i] = x[i] / y[i];} break;
+    case ARR_LT: for (long i = 0; i < n; i++) { m[i] = x[i] < y[i];} break;
+    case ARR_GT: for (long i = 0; i < n; i++) { m[i] = x[i] > y[i];} break;
+    case ARR_EQ: for (long i = 0; i < n; i++) { m[i] = x[i] == y[i];} break;
+    }
+}
+
+#ifdef LARR_SIMD
+
+#define AVX2 __attribute__((target("avx2")))
+#define SSE2 __attribute__((target("sse2")))
+#define LOAD256(p) _mm256_loadu_si256((__m256i*)(p))
+#define LOAD128(p) _mm_loadu_si128((__m128i*)(p))
+
+//AVX2 has no 64 bit multiply, build it from 32 bit halves
+AVX2 static inline __m256i larr_mul256(__m256i a, __m256i b)
+{
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_mullo_epi32(a, _mm256_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+    cross = _mm256_add_epi32(cross, _mm256_srli_epi64(cross, 32));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static long larr_hsum256(__m256i v)
+{
+    unsigned long t[4];
+    _mm256_storeu_si256((__m256i*)t, v);
+    return t[0] + t[1] + t[2] + t[3];
+}
+
+AVX2 static double larr_fhsum256(__m256d v)
+{
+    double t[4];
+    _mm256_storeu_pd(t, v);
+    return (t[0] + t[1]) + (t[2] + t[3]);
+}
+
+AVX2 static long larr_sum_avx2(long* x, long n)
+{
+    __m256i s0 = _mm256_setzero_si256();
+    __m256i s1 = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_epi64(s0, LOAD256(x + i));
+        s1 = _mm256_add_epi64(s1, LOAD256(x + i + 4));
+    }
+    unsigned long s = larr_hsum256(_mm256_add_epi64(s0, s1));
+    for (; i < n; i++) { s += x[i];}
+    return s;
+}
+
+AVX2 static double larr_fsum_avx2(double* x, long n)
+{
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(x + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(x + i + 4));
+    }
+    double s = larr_fhsum256(_mm256_add_pd(s0, s1));
+    for (; i < n; i++) { s += x[i];}
+    return s;
+}
+
+SSE2 static long larr_sum_sse2(long* x, long n)
+{
+    __m128i s0 = _mm_setzero_si128();
+    __m128i s1 = _mm_setzero_si128();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_epi64(s0, LOAD128(x + i));
+        s1 = _mm_add_epi64(s1, LOAD128(x + i + 2));
+    }
+    unsigned long t[2];
+    _mm_storeu_si128((__m128i*)t, _mm_add_epi64(s0, s1));
+    unsigned long s = t[0] + t[1];
+    for (; i < n; i++) { s += x[i];}
+    return s;
+}
+
+SSE2 static double larr_fsum_sse2(double* x, long n)
+{
+    __m128d s0 = _mm_setzero_pd();
+    __m128d s1 = _mm_setzero_pd();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(x + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(x + i + 2));
+    }
+    double t[2];
+    _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+    double s = t[0] + t[1];
+    for (; i < n; i++) { s += x[i];}
+    return s;
+}
+
+AVX2 static long larr_dot_avx2(long* x, long* y, long n)
+{
+    __m256i s = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s = _mm256_add_epi64(s, larr_mul256(LOAD256(x + i), LOAD256(y + i)));
+    }
+    unsigned long d = larr_hsum256(s);
+    for (; i < n; i++) { d += (unsigned long)x[i] * y[i];}
+    return d;
+}
+
+AVX2 static double larr_fdot_avx2(double* x, double* y, long n)
+{
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    double d = larr_fhsum256(_mm256_add_pd(s0, s1));
+    for (; i < n; i++) { d += x[i] * y[i];}
+    return d;
+}
+
+//smallest or largest element of a non-empty array
+AVX2 static long larr_extreme_avx2(long* x, long n, int max)
+{
+    long i = 0;
+    long m = x[0];
+    if(n >= 4){
+        __m256i v = LOAD256(x);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256i y = LOAD256(x + i);
+            __m256i take = max ? _mm256_cmpgt_epi64(y, v) : _mm256_cmpgt_epi64(v, y);
+            v = _mm256_blendv_epi8(v, y, take);
+        }
+        long t[4];
+        _mm256_storeu_si256((__m256i*)t, v);
+        m = t[0];
+        for (int j = 1; j < 4; j++) { if(max ? t[j] > m : t[j] < m) { m = t[j];}}
+    }
+    for (; i < n; i++) { if(max ? x[i] > m : x[i] < m) { m = x[i];}}
+    return m;
+}
+
+AVX2 static double larr_fextreme_avx2(double* x, long n, int max)
+{
+    long i = 0;
+    double m = x[0];
+    if(n >= 4){
+        __m256d v = _mm256_loadu_pd(x);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256d y = _mm256_loadu_pd(x + i);
+            v = max ? _mm256_max_pd(v, y) : _mm256_min_pd(v, y);
+        }
+        double t[4];
+        _mm256_storeu_pd(t, v);
+        m = t[0];
+        for (int j = 1; j < 4; j++) { if(max ? t[j] > m : t[j] < m) { m = t[j];}}
+    }
+    for (; i < n; i++) { if(max ? x[i] > m : x[i] < m) { m = x[i];}}
+    return m;
+}
+
+AVX2 static void larr_scan_avx2(long* r, long* x, long n)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i carry = zero;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = LOAD256(x + i);
+        //prefix sums within each half, then the low half's total into the high
+        v = _mm256_add_epi64(v, _mm256_slli_si256(v, 8));
+        v = _mm256_add_epi64(v, _mm256_blend_epi32(zero, _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 1, 1, 1)), 0xF0));
+        v = _mm256_add_epi64(v, carry);
+        _mm256_storeu_si256((__m256i*)(r + i), v);
+        carry = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    unsigned long s = i ? r[i - 1] : 0;
+    for (; i < n; i++) { s += x[i]; r[i] = s;}
+}
+
+#define LARR_LOOP256(expr) \
+    for (; i + 4 <= n; i += 4) { \
+        __m256i a = LOAD256(x + i), b = LOAD256(y + i); \
+        _mm256_storeu_si256((__m256i*)(r + i), expr); \
+    }
+
+AVX2 static void larr_avx2(int op, long* r, long* x, long* y, long n)
+{
+    __m256i one = _mm256_set1_epi64x(1);
+    long i = 0;
+
+    switch(op){
+    case ARR_ADD: LARR_LOOP256(_mm256_add_epi64(a, b)); break;
+    case ARR_SUB: LARR_LOOP256(_mm256_sub_epi64(a, b)); break;
+    case ARR_MUL: LARR_LOOP256(larr_mul256(a, b)); break;
+    case ARR_LT: LARR_LOOP256(_mm256_and_si256(_mm256_cmpgt_epi64(b, a), one)); break;
+    case ARR_GT: LARR_LOOP256(_mm256_and_si256(_mm256_cmpgt_epi64(a, b), one)); break;
+    case ARR_EQ: LARR_LOOP256(_mm256_and_si256(_mm256_cmpeq_epi64(a, b), one)); break;
+    }
+    larr_scalar(op, r + i, x + i, y + i, n - i);
+}
+
+#define LARR_FLOOP256(expr) \
+    for (; i + 4 <= n; i += 4) { \
+        __m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(y + i); \
+        _mm256_storeu_pd(f + i, expr); \
+    }
+
+#define LARR_MLOOP256(cmp) \
+    for (; i + 4 <= n; i += 4) { \
+        __m256d c = _mm256_cmp_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), cmp); \
+        _mm256_storeu_si256((__m256i*)(m + i), _mm256_and_si256(_mm256_castpd_si256(c), one)); \
+    }
+
+AVX2 static void larr_favx2(int op, double* f, long* m, double* x, double* y, long n)
+{
+    __m256i one = _mm256_set1_epi64x(1);
+    long i = 0;
+
+    switch(op){
+    case ARR_ADD: LARR_FLOOP256(_mm256_add_pd(a, b)); break;
+    case ARR_SUB: LARR_FLOOP256(_mm256_sub_pd(a, b)); break;
+    case ARR_MUL: LARR_FLOOP256(_mm256_mul_pd(a, b)); break;
+    case ARR_DIV: LARR_FLOOP256(_mm256_div_pd(a, b)); break;
+    case ARR_LT: LARR_MLOOP256(_CMP_LT_OQ); break;
+    case ARR_GT: LARR_MLOOP256(_CMP_GT_OQ); break;
+    case ARR_EQ: LARR_MLOOP256(_CMP_EQ_OQ); break;
+    }
+    larr_fscalar(op, f ? f + i : NULL, m ? m + i : NULL, x + i, y + i, n - i);
+}
+
+SSE2 static void larr_sse2(int op, long* r, long* x, long* y, long n)
+{
+    long i = 0;
+
+    for (; (op == ARR_ADD || op == ARR_SUB) && i + 2 <= n; i += 2) {
+        __m128i a = LOAD128(x + i), b = LOAD128(y + i);
+        _mm_storeu_si128((__m128i*)(r + i), op == ARR_ADD ? _mm_add_epi64(a, b) : _mm_sub_epi64(a, b));
+    }
+    larr_scalar(op, r + i, x + i, y + i, n - i);
+}
+
+#endif
+
+static long larr_sum(long* x, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { return larr_sum_avx2(x, n);}
+    if(larr_level() == 1) { return larr_sum_sse2(x, n);}
+#endif
+    unsigned long s = 0;
+    for (long i = 0; i < n; i++) { s += x[i];}
+    return s;
+}
+
+static double larr_fsum(double* x, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { return larr_fsum_avx2(x, n);}
+    if(larr_level() == 1) { return larr_fsum_sse2(x, n);}
+#endif
+    double s = 0;
+    for (long i = 0; i < n; i++) { s += x[i];}
+    return s;
+}
+
+static long larr_product(long* x, long n)
+{
+    //four chains keep the multiplier busy
+    unsigned long p[4] = {1, 1, 1, 1};
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        for (int j = 0; j < 4; j++) { p[j] *= x[i + j];}
+    }
+    for (; i < n; i++) { p[0] *= x[i];}
+    return p[0] * p[1] * p[2] * p[3];
+}
+
+static double larr_fproduct(double* x, long n)
+{
+    double p = 1;
+    for (long i = 0; i < n; i++) { p *= x[i];}
+    return p;
+}
+
+static long larr_dot(long* x, long* y, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { return larr_dot_avx2(x, y, n);}
+#endif
+    unsigned long d = 0;
+    for (long i = 0; i < n; i++) { d += (unsigned long)x[i] * y[i];}
+    return d;
+}
+
+static double larr_fdot(double* x, double* y, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { return larr_fdot_avx2(x, y, n);}
+#endif
+    double d = 0;
+    for (long i = 0; i < n; i++) { d += x[i] * y[i];}
+    return d;
+}
+
+static long larr_extreme(long* x, long n, int max)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { return larr_extreme_avx2(x, n, max);}
+#endif
+    long m = x[0];
+    for (long i = 1; i < n; i++) { if(max ? x[i] > m : x[i] < m) { m = x[i];}}
+    return m;
+}
+
+static double larr_fextreme(double* x, long n, int max)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { return larr_fextreme_avx2(x, n, max);}
+#endif
+    double m = x[0];
+    for (long i = 1; i < n; i++) { if(max ? x[i] > m : x[i] < m) { m = x[i];}}
+    return m;
+}
+
+static void larr_scan(long* r, long* x, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { larr_scan_avx2(r, x, n); return;}
+#endif
+    unsigned long s = 0;
+    for (long i = 0; i < n; i++) { s += x[i]; r[i] = s;}
+}
+
+//running sums of doubles depend on their order, so they stay sequential
+static void larr_fscan(double* r, double* x, long n)
+{
+    double s = 0;
+    for (long i = 0; i < n; i++) { s += x[i]; r[i] = s;}
+}
+
+static void larr_zip(int op, long* r, long* x, long* y, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { larr_avx2(op, r, x, y, n); return;}
+    if(larr_level() == 1) { larr_sse2(op, r, x, y, n); return;}
+#endif
+    larr_scalar(op, r, x, y, n);
+}
+
+static void larr_fzip(int op, double* f, long* m, double* x, double* y, long n)
+{
+#ifdef LARR_SIMD
+    if(larr_level() == 2) { larr_favx2(op, f, m, x, y, n); return;}
+#endif
+    larr_fscalar(op, f, m, x, y, n);
+}
+
+static lval* builtin_array(lenv* e, lval* a)
+{
+    LASSERT_NUM("array", a, 1);
+
+    lval* x = a->cell[0];
+    if(x->type == LVAL_VEC && !x->vec->boxed){
+        larr* r = larr_new(x->vec->count);
+        memcpy(r->data, x->vec->nums, sizeof(long) * r->count);
+        lval_del(a);
+        return lval_arr(r);
+    }
+
+    LASSERT(a, (x->type == LVAL_QEXPR || x->type == LVAL_VEC),
+            "Function 'array' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+            ltype_name(x->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_VEC));
+
+    int count = x->type == LVAL_VEC ? x->vec->count : x->count;
+    lval** items = x->type == LVAL_VEC ? x->vec->items : x->cell;
+    int f64 = 0;
+    for (int i = 0; i < count; i++) {
+        LASSERT(a, (items[i]->type == LVAL_NUM || items[i]->type == LVAL_DBL),
+                "Function 'array' passed incorrect type for element %i. Got %s, Expected %s.",
+                i, ltype_name(items[i]->type), ltype_name(LVAL_NUM));
+        f64 |= items[i]->type == LVAL_DBL;
+    }
+
+    //any double makes an array of doubles
+    larr* r = f64 ? larr_new_f64(count) : larr_new(count);
+    for (int i = 0; i < count; i++) {
+        if(!f64) { r->data[i] = items[i]->num;}
+        else { r->fdata[i] = items[i]->type == LVAL_DBL ? items[i]->dbl : items[i]->num;}
+    }
+    lval_del(a);
+    return lval_arr(r);
+}
+
+static lval* builtin_array_range(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count == 1 || a->count == 2),
+            "Function 'array-range' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+    for (int i = 0; i < a->count; i++) {LASSERT_TYPE("array-range", a, i, LVAL_NUM);}
+
+    long start = a->count == 2 ? a->cell[0]->num : 0;
+    long end = a->cell[a->count - 1]->num;
+    larr* r = larr_new(end > start ? end - start : 0);
+    for (long i = 0; i < r->count; i++) { r->data[i] = start + i;}
+
+    lval_del(a);
+    return lval_arr(r);
+}
+
+static lval* builtin_array_len(lenv* e, lval* a)
+{
+    LASSERT_NUM("array-len", a, 1);
+    LASSERT_TYPE("array-len", a, 0, LVAL_ARR);
+
+    lval* x = lval_num(a->cell[0]->arr->count);
+    lval_del(a);
+    return x;
+}
+
+//element 'i' as a new value
+static lval* larr_get(larr* r, long i)
+{
+    return r->fdata ? lval_dbl(r->fdata[i]) : lval_num(r->data[i]);
+}
+
+static lval* builtin_array_ref(lenv* e, lval* a)
+{
+    LASSERT_NUM("array-ref", a, 2);
+    LASSERT_TYPE("array-ref", a, 0, LVAL_ARR);
+    LASSERT_TYPE("array-ref", a, 1, LVAL_NUM);
+
+    larr* r = a->cell[0]->arr;
+    long i = a->cell[1]->num;
+    LASSERT_INDEX("array-ref", a, r, i, 0);
+
+    lval* x = larr_get(r, i);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_array_list(lenv* e, lval* a)
+{
+    LASSERT_NUM("array->list", a, 1);
+    LASSERT_TYPE("array->list", a, 0, LVAL_ARR);
+
+    larr* r = a->cell[0]->arr;
+    lval* x = lval_qexpr();
+    for (long i = 0; i < r->count; i++) { lval_add(x, larr_get(r, i));}
+
+    lval_del(a);
+    return x;
+}
+
+//'op' is ARR_ADD or ARR_MUL, or ARR_LT and ARR_GT for the least and greatest
+static lval* builtin_array_reduce(lenv* e, lval* a, int op, char* func)
+{
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_ARR);
+
+    larr* r = a->cell[0]->arr;
+    lval* x;
+    switch(op){
+    case ARR_ADD:
+        x = r->fdata ? lval_dbl(larr_fsum(r->fdata, r->count)) : lval_num(larr_sum(r->data, r->count));
+        break;
+    case ARR_MUL:
+        x = r->fdata ? lval_dbl(larr_fproduct(r->fdata, r->count)) : lval_num(larr_product(r->data, r->count));
+        break;
+    default:
+        LASSERT(a, (r->count != 0), "Function '%s' passed empty array!", func);
+        int max = op == ARR_GT;
+        x = r->fdata ? lval_dbl(larr_fextreme(r->fdata, r->count, max)) : lval_num(larr_extreme(r->data, r->count, max));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_array_sum(lenv* e, lval* a) { return builtin_array_reduce(e, a, ARR_ADD, "array-sum");}
+static lval* builtin_array_product(lenv* e, lval* a) { return builtin_array_reduce(e, a, ARR_MUL, "array-product");}
+static lval* builtin_array_min(lenv* e, lval* a) { return builtin_array_reduce(e, a, ARR_LT, "array-min");}
+static lval* builtin_array_max(lenv* e, lval* a) { return builtin_array_reduce(e, a, ARR_GT, "array-max");}
+
+static lval* builtin_array_dot(lenv* e, lval* a)
+{
+    LASSERT_NUM("array-dot", a, 2);
+    LASSERT_TYPE("array-dot", a, 0, LVAL_ARR);
+    LASSERT_TYPE("array-dot", a, 1, LVAL_ARR);
+
+    larr* x = a->cell[0]->arr;
+    larr* y = a->cell[1]->arr;
+    LASSERT(a, (x->count == y->count),
+            "Function 'array-dot' passed arrays of different lengths. Got %li and %li.", x->count, y->count);
+
+    lval* r;
+    if(x->fdata || y->fdata){
+        x = larr_f64(x);
+        y = larr_f64(y);
+        r = lval_dbl(larr_fdot(x->fdata, y->fdata, x->count));
+        larr_del(x);
+        larr_del(y);
+    }else{
+        r = lval_num(larr_dot(x->data, y->data, x->count));
+    }
+
+    lval_del(a);
+    return r;
+}
+
+static lval* builtin_array_scan(lenv* e, lval* a)
+{
+    LASSERT_NUM("array-scan", a, 1);
+    LASSERT_TYPE("array-scan", a, 0, LVAL_ARR);
+
+    larr* x = a->cell[0]->arr;
+    larr* r;
+    if(x->fdata){
+        r = larr_new_f64(x->count);
+        larr_fscan(r->fdata, x->fdata, x->count);
+    }else{
+        r = larr_new(x->count);
+        larr_scan(r->data, x->data, x->count);
+    }
+
+    lval_del(a);
+    return lval_arr(r);
+}
+
+//elementwise operations, a number on the right applies to every element,
+//doubles on either side make both sides doubles
+static lval* builtin_array_zip(lenv* e, lval* a, int op, char* func)
+{
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_ARR);
+
+    larr* x = a->cell[0]->arr;
+    lval* b = a->cell[1];
+    larr* y;
+    if(b->type == LVAL_NUM || b->type == LVAL_DBL){
+        y = b->type == LVAL_DBL ? larr_new_f64(x->count) : larr_new(x->count);
+        for (long i = 0; i < y->count; i++) {
+            if(y->fdata) { y->fdata[i] = b->dbl;}
+            else { y->data[i] = b->num;}
+        }
+    }else{
+        LASSERT_TYPE(func, a, 1, LVAL_ARR);
+        y = b->arr;
+        y->refs++;
+    }
+    x->refs++;
+
+    lval* err = NULL;
+    if(x->count != y->count){
+        err = lval_err("Function '%s' passed arrays of different lengths. Got %li and %li.",
+                       func, x->count, y->count);
+    }
+    for (long i = 0; !err && op == ARR_DIV && i < y->count; i++) {
+        if(y->fdata ? y->fdata[i] == 0 : y->data[i] == 0) { err = lval_err_const(LERR_DIVZERO);}
+    }
+
+    larr* r = NULL;
+    if(!err && (x->fdata || y->fdata)){
+        larr* fx = larr_f64(x);
+        larr* fy = larr_f64(y);
+        larr_del(x);
+        larr_del(y);
+        x = fx;
+        y = fy;
+
+        r = op >= ARR_LT ? larr_new(x->count) : larr_new_f64(x->count);
+        larr_fzip(op, r->fdata, r->data, x->fdata, y->fdata, x->count);
+    }else if(!err){
+        r = larr_new(x->count);
+        larr_zip(op, r->data, x->data, y->data, x->count);
+    }
+
+    larr_del(x);
+    larr_del(y);
+    lval_del(a);
+    return err ? err : lval_arr(r);
+}
+
+static lval* builtin_array_add(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_ADD, "array-add");}
+static lval* builtin_array_sub(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_SUB, "array-sub");}
+static lval* builtin_array_mul(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_MUL, "array-mul");}
+static lval* builtin_array_div(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_DIV, "array-div");}
+static lval* builtin_array_lt(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_LT, "array-lt");}
+static lval* builtin_array_gt(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_GT, "array-gt");}
+static lval* builtin_array_eq(lenv* e, lval* a) { return builtin_array_zip(e, a, ARR_EQ, "array-eq");}
+
+// Matrices
+//
+// Products are computed block by block so the tiles of both operands stay
+// in cache, and large ones are split by rows across threads.
+
+#define MAT_BLOCK 64
+#define MAT_PARALLEL (1L << 21)
+#define MAT_THREADS 8
+
+static lmat* lmat_new(long rows, long cols)
+{
+    lmat* m = malloc(sizeof(lmat));
+    m->refs = 1;
+    m->rows = rows;
+    m->cols = cols;
+    m->data = calloc(rows * cols > 0 ? rows * cols : 1, sizeof(double));
+    return m;
+}
+
+static void lmat_del(lmat* m)
+{
+    if(--m->refs) { return;}
+    free(m->data);
+    free(m);
+}
+
+static lval* lval_mat(lmat* m)
+{
+    lval* v = lval_alloc(LVAL_MAT);
+    v->mat = m;
+    return v;
+}
+
+typedef struct {
+    lmat* c;
+    lmat* a;
+    lmat* b;
+    long lo;
+    long hi;
+} lmat_job;
+
+//rows lo up to hi of c = a b, with c zeroed
+static void* lmat_mul_rows(void* arg)
+{
+    lmat_job* job = arg;
+    long n = job->a->cols;
+    long m = job->b->cols;
+    double* a = job->a->data;
+    double* b = job->b->data;
+    double* c = job->c->data;
+
+    for (long ii = job->lo; ii < job->hi; ii += MAT_BLOCK) {
+        long ie = ii + MAT_BLOCK < job->hi ? ii + MAT_BLOCK : job->hi;
+        for (long kk = 0; kk < n; kk += MAT_BLOCK) {
+            long ke = kk + MAT_BLOCK < n ? kk + MAT_BLOCK : n;
+            for (long jj = 0; jj < m; jj += MAT_BLOCK) {
+                long je = jj + MAT_BLOCK < m ? jj + MAT_BLOCK : m;
+
+                for (long i = ii; i < ie; i++) {
+                    double* restrict ci = c + i * m;
+                    for (long k = kk; k < ke; k++) {
+                        double aik = a[i * n + k];
+                        const double* restrict bk = b + k * m;
+                        for (long j = jj; j < je; j++) { ci[j] += aik * bk[j];}
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static lmat* lmat_mul(lmat* a, lmat* b)
+{
+    lmat* c = lmat_new(a->rows, b->cols);
+
+    int threads = 1;
+    if(a->rows * a->cols * b->cols >= MAT_PARALLEL){
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(threads > MAT_THREADS) { threads = MAT_THREADS;}
+        if(threads > a->rows / MAT_BLOCK) { threads = a->rows / MAT_BLOCK;}
+        if(threads < 1) { threads = 1;}
+    }
+
+    //whole blocks of rows to each thread, the last one runs here, as does
+    //any a thread could not be made for. 'ids' holds the threads made
+    lmat_job jobs[MAT_THREADS];
+    pthread_t ids[MAT_THREADS];
+    long per = (a->rows / threads + MAT_BLOCK - 1) / MAT_BLOCK * MAT_BLOCK;
+    int started = 0;
+    
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (lmat_job){c, a, b, t * per, t == threads - 1 ? a->rows : (t + 1) * per};
+        if(jobs[t].lo >= a->rows) { break;}
+        if(jobs[t].hi > a->rows) { jobs[t].hi = a->rows;}
+        
+        if(t == threads - 1 || pthread_create(&ids[started], NULL, lmat_mul_rows, &jobs[t]) != 0){
+            lmat_mul_rows(&jobs[t]);
+        }else{
+            started++;
+        }
+    }
+    for (int t = 0; t < started; t++) { pthread_join(ids[t], NULL);}
+    
+    return c;
+}
+
+static lmat* lmat_transpose(lmat* a)
+{
+    lmat* t = lmat_new(a->cols, a->rows);
+    for (long ii = 0; ii < a->rows; ii += MAT_BLOCK) {
+        for (long jj = 0; jj < a->cols; jj += MAT_BLOCK) {
+            for (long i = ii; i < ii + MAT_BLOCK && i < a->rows; i++) {
+                for (long j = jj; j < jj + MAT_BLOCK && j < a->cols; j++) {
+                    t->data[j * a->rows + i] = a->data[i * a->cols + j];
+                }
+            }
+        }
+    }
+    return t;
+}
+
+static lval* builtin_mat(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat", a, 1);
+    LASSERT_TYPE("mat", a, 0, LVAL_QEXPR);
+
+    lval* q = a->cell[0];
+    long cols = q->count ? q->cell[0]->count : 0;
+    for (int i = 0; i < q->count; i++) {
+        lval* r = q->cell[i];
+        LASSERT(a, (r->type == LVAL_QEXPR),
+                "Function 'mat' passed incorrect type for row %i. Got %s, Expected %s.",
+                i, ltype_name(r->type), ltype_name(LVAL_QEXPR));
+        LASSERT(a, (r->count == cols),
+                "Function 'mat' passed row %i of length %i. Expected %li.", i, r->count, cols);
+        for (int j = 0; j < r->count; j++) {
+            LASSERT(a, (r->cell[j]->type == LVAL_NUM || r->cell[j]->type == LVAL_DBL),
+                    "Function 'mat' passed incorrect type for element %i of row %i. Got %s, Expected %s.",
+                    j, i, ltype_name(r->cell[j]->type), ltype_name(LVAL_NUM));
+        }
+    }
+
+    lmat* m = lmat_new(q->count, cols);
+    for (long i = 0; i < m->rows; i++) {
+        for (long j = 0; j < cols; j++) { m->data[i * cols + j] = lval_to_dbl(q->cell[i]->cell[j]);}
+    }
+
+    lval_del(a);
+    return lval_mat(m);
+}
+
+static lval* builtin_mat_shape(lenv* e, lval* a, int rows, char* func)
+{
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_MAT);
+
+    lmat* m = a->cell[0]->mat;
+    lval* x = lval_num(rows ? m->rows : m->cols);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_mat_rows(lenv* e, lval* a) { return builtin_mat_shape(e, a, 1, "mat-rows");}
+static lval* builtin_mat_cols(lenv* e, lval* a) { return builtin_mat_shape(e, a, 0, "mat-cols");}
+
+static lval* builtin_mat_ref(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat-ref", a, 3);
+    LASSERT_TYPE("mat-ref", a, 0, LVAL_MAT);
+    LASSERT_TYPE("mat-ref", a, 1, LVAL_NUM);
+    LASSERT_TYPE("mat-ref", a, 2, LVAL_NUM);
+
+    lmat* m = a->cell[0]->mat;
+    long i = a->cell[1]->num;
+    long j = a->cell[2]->num;
+    LASSERT(a, (i >= 0 && i < m->rows && j >= 0 && j < m->cols),
+            "Function 'mat-ref' passed index %li %li out of range. Expected below %li %li.",
+            i, j, m->rows, m->cols);
+
+    lval* x = lval_dbl(m->data[i * m->cols + j]);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_mat_t(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat-t", a, 1);
+    LASSERT_TYPE("mat-t", a, 0, LVAL_MAT);
+
+    lmat* t = lmat_transpose(a->cell[0]->mat);
+    lval_del(a);
+    return lval_mat(t);
+}
+
+static lval* builtin_mat_mul(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat-mul", a, 2);
+    LASSERT_TYPE("mat-mul", a, 0, LVAL_MAT);
+    LASSERT_TYPE("mat-mul", a, 1, LVAL_MAT);
+
+    lmat* x = a->cell[0]->mat;
+    lmat* y = a->cell[1]->mat;
+    LASSERT(a, (x->cols == y->rows),
+            "Function 'mat-mul' passed matrices of incompatible shapes. Got %lix%li and %lix%li.",
+            x->rows, x->cols, y->rows, y->cols);
+
+    lmat* c = lmat_mul(x, y);
+    lval_del(a);
+    return lval_mat(c);
+}
+
+//matrix times a list or array of numbers, as an array of doubles
+static lval* builtin_mat_vec(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat-vec", a, 2);
+    LASSERT_TYPE("mat-vec", a, 0, LVAL_MAT);
+    
+    lmat* m = a->cell[0]->mat;
+    lval* v = a->cell[1];
+    LASSERT(a, (v->type == LVAL_QEXPR || v->type == LVAL_ARR),
+            "Function 'mat-vec' passed incorrect type for argument 1. Got %s, Expected %s or %s.",
+            ltype_name(v->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_ARR));
+    
+    long n = v->type == LVAL_ARR ? v->arr->count : v->count;
+    LASSERT(a, (n == m->cols),
+            "Function 'mat-vec' passed vector of length %li. Expected %li.", n, m->cols);
+
+    double* x = malloc(sizeof(double) * (n ? n : 1));
+    for (long j = 0; j < n; j++) {
+        if(v->type == LVAL_ARR) { x[j] = v->arr->fdata ? v->arr->fdata[j] : v->arr->data[j]; continue;}
+        if(v->cell[j]->type != LVAL_NUM && v->cell[j]->type != LVAL_DBL){
+            lval* err = lval_err("Function 'mat-vec' passed incorrect type for element %li. Got %s, Expected %s.",
+                                 j, ltype_name(v->cell[j]->type), ltype_name(LVAL_NUM));
+            free(x);
+            lval_del(a);
+            return err;
+        }
+        x[j] = lval_to_dbl(v->cell[j]);
+    }
+
+    larr* r = larr_new_f64(m->rows);
+    for (long i = 0; i < m->rows; i++) {
+        double s = 0;
+        for (long j = 0; j < n; j++) { s += m->data[i * n + j] * x[j];}
+        r->fdata[i] = s;
+    }
+
+    free(x);
+    lval_del(a);
+    return lval_arr(r);
+}
+
+static lval* builtin_mat_row_sums(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat-row-sums", a, 1);
+    LASSERT_TYPE("mat-row-sums", a, 0, LVAL_MAT);
+
+    lmat* m = a->cell[0]->mat;
+    larr* r = larr_new_f64(m->rows);
+    for (long i = 0; i < m->rows; i++) {
+        double s = 0;
+        for (long j = 0; j < m->cols; j++) { s += m->data[i * m->cols + j];}
+        r->fdata[i] = s;
+    }
+
+    lval_del(a);
+    return lval_arr(r);
+}
+
+static lval* builtin_mat_col_sums(lenv* e, lval* a)
+{
+    LASSERT_NUM("mat-col-sums", a, 1);
+    LASSERT_TYPE("mat-col-sums", a, 0, LVAL_MAT);
+
+    //walk rows in order so the sums are updated along contiguous memory
+    lmat* m = a->cell[0]->mat;
+    larr* r = larr_new_f64(m->cols);
+    for (long j = 0; j < m->cols; j++) { r->fdata[j] = 0;}
+    for (long i = 0; i < m->rows; i++) {
+        for (long j = 0; j < m->cols; j++) { r->fdata[j] += m->data[i * m->cols + j];}
+    }
+
+    lval_del(a);
+    return lval_arr(r);
+}
+
+// Strings
+//
+// Substrings are found with memchr for single characters and with the
+// Two-Way algorithm otherwise, which is linear in the text and needs no
+// tables. Strings are built in a text buffer, and string builders keep one
+// across calls so a loop of appends stays linear overall.
+
+//the position where the suffix of 'n' that is largest under the order
+//starts, and its period, reversing the order when 'rev' is set
+static long lstr_maxsuf(const unsigned char* n, long l, int rev, long* period)
+{
+    long ip = -1, jp = 0, k = 1, p = 1;
+    while(jp + k < l){
+        unsigned char a = n[ip + k], b = n[jp + k];
+        if(a == b){
+            if(k == p) { jp += p; k = 1;}
+            else { k++;}
+        }else if(rev ? a < b : a > b){
+            jp += k;
+            k = 1;
+            p = jp - ip;
+        }else{
+            ip = jp++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return ip;
+}
+
+//first position of 'n' in 'h' or -1
+static long lstr_find(const char* hs, long hl, const char* ns, long l)
+{
+    const unsigned char* h = (const unsigned char*)hs;
+    const unsigned char* n = (const unsigned char*)ns;
+    if(l == 0) { return 0;}
+    if(l > hl) { return -1;}
+    if(l == 1){
+        const unsigned char* r = memchr(h, n[0], hl);
+        return r ? r - h : -1;
+    }
+
+    //split the needle at its critical factorization
+    long p, p0;
+    long ms = lstr_maxsuf(n, l, 0, &p0);
+    long ms1 = lstr_maxsuf(n, l, 1, &p);
+    if(ms1 > ms) { ms = ms1;}
+    else { p = p0;}
+
+    //a periodic needle remembers how much of its left part is known to match
+    long mem0, mem = 0;
+    if(memcmp(n, n + p, ms + 1)){
+        mem0 = 0;
+        p = (ms > l - ms - 1 ? ms : l - ms - 1) + 1;
+    }else{
+        mem0 = l - p;
+    }
+
+    for (long pos = 0; pos + l <= hl;) {
+        const unsigned char* t = h + pos;
+        long k = ms + 1 > mem ? ms + 1 : mem;
+        while(k < l && n[k] == t[k]) { k++;}
+        if(k < l) { pos += k - ms; mem = 0; continue;}
+
+        k = ms + 1;
+        while(k > mem && n[k - 1] == t[k - 1]) { k--;}
+        if(k <= mem) { return pos;}
+        pos += p;
+        mem = mem0;
+    }
+    return -1;
+}
+
+//strings as their text, anything else as it prints
+static void lval_display(lbuf* b, lval* v)
+{
+    if(v->type == LVAL_STR) { lbuf_add(b, v->str, v->slen);}
+    else { lval_write(b, v);}
+}
+
+static lval* lval_buf_str(lbuf* b)
+{
+    lval* x = lval_str_n(b->s, b->len);
+    lbuf_del(b);
+    return x;
+}
+
+static lval* builtin_concat(lenv* e, lval* a)
+{
+    for (int i = 0; i < a->count; i++) {LASSERT_TYPE("concat", a, i, LVAL_STR);}
+
+    lbuf* b = lbuf_new();
+    for (int i = 0; i < a->count; i++) { lbuf_add(b, a->cell[i]->str, a->cell[i]->slen);}
+    lval_del(a);
+    return lval_buf_str(b);
+}
+
+static lval* builtin_substring(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count == 2 || a->count == 3),
+            "Function 'substring' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("substring", a, 0, LVAL_STR);
+    for (int i = 1; i < a->count; i++) {LASSERT_TYPE("substring", a, i, LVAL_NUM);}
+
+    char* s = a->cell[0]->str;
+    long len = a->cell[0]->slen;
+    long start = a->cell[1]->num;
+    long end = a->count == 3 ? a->cell[2]->num : len;
+    LASSERT(a, (0 <= start && start <= end && end <= len),
+            "Function 'substring' passed range %li to %li. Expected within 0 to %li.", start, end, len);
+
+    lbuf* b = lbuf_new();
+    lbuf_add(b, s + start, end - start);
+    lval_del(a);
+    return lval_buf_str(b);
+}
+
+static lval* builtin_str_index(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count == 2 || a->count == 3),
+            "Function 'str-index' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("str-index", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-index", a, 1, LVAL_STR);
+
+    char* s = a->cell[0]->str;
+    long len = a->cell[0]->slen;
+    long from = 0;
+    if(a->count == 3){
+        LASSERT_TYPE("str-index", a, 2, LVAL_NUM);
+        from = a->cell[2]->num;
+        LASSERT(a, (0 <= from && from <= len),
+                "Function 'str-index' passed start %li. Expected 0 to %li.", from, len);
+    }
+
+    long i = lstr_find(s + from, len - from, a->cell[1]->str, a->cell[1]->slen);
+    lval_del(a);
+    return lval_num(i < 0 ? -1 : from + i);
+}
+
+static lval* builtin_str_split(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-split", a, 2);
+    LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+
+    char* s = a->cell[0]->str;
+    char* sep = a->cell[1]->str;
+    long len = a->cell[0]->slen, sl = a->cell[1]->slen;
+    LASSERT(a, (sl > 0), "Function 'str-split' passed empty separator!");
+
+    lval* x = lval_qexpr();
+    long pos = 0;
+    for (;;) {
+        long i = lstr_find(s + pos, len - pos, sep, sl);
+        long end = i < 0 ? len : pos + i;
+
+        lbuf* b = lbuf_new();
+        lbuf_add(b, s + pos, end - pos);
+        lval_add(x, lval_buf_str(b));
+
+        if(i < 0) { break;}
+        pos = end + sl;
+    }
+
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_str_join(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-join", a, 2);
+    LASSERT_TYPE("str-join", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("str-join", a, 1, LVAL_STR);
+
+    lval* l = a->cell[0];
+    for (int i = 0; i < l->count; i++) {
+        LASSERT(a, (l->cell[i]->type == LVAL_STR),
+                "Function 'str-join' passed incorrect type for element %i. Got %s, Expected %s.",
+                i, ltype_name(l->cell[i]->type), ltype_name(LVAL_STR));
+    }
+
+    lbuf* b = lbuf_new();
+    for (int i = 0; i < l->count; i++) {
+        if(i) { lbuf_add(b, a->cell[1]->str, a->cell[1]->slen);}
+        lbuf_add(b, l->cell[i]->str, l->cell[i]->slen);
+    }
+    lval_del(a);
+    return lval_buf_str(b);
+}
+
+static lval* builtin_str_replace(lenv* e, lval* a)
+{
+    LASSERT_NUM("str-replace", a, 3);
+    for (int i = 0; i < 3; i++) {LASSERT_TYPE("str-replace", a, i, LVAL_STR);}
+
+    char* s = a->cell[0]->str;
+    char* old = a->cell[1]->str;
+    long len = a->cell[0]->slen, ol = a->cell[1]->slen;
+    LASSERT(a, (ol > 0), "Function 'str-replace' passed empty string to replace!");
+
+    lbuf* b = lbuf_new();
+    long pos = 0;
+    for (;;) {
+        long i = lstr_find(s + pos, len - pos, old, ol);
+        if(i < 0) { break;}
+        lbuf_add(b, s + pos, i);
+        lbuf_add(b, a->cell[2]->str, a->cell[2]->slen);
+        pos += i + ol;
+    }
+    lbuf_add(b, s + pos, len - pos);
+
+    lval_del(a);
+    return lval_buf_str(b);
+}
+
+static lval* builtin_str_case(lenv* e, lval* a, char* func)
+{
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_STR);
+
+    //the characters may be shared, so change a new string
+    lval* x = lval_str_n(a->cell[0]->str, a->cell[0]->slen);
+    int up = strcmp(func, "upcase") == 0;
+    for (long i = 0; i < x->slen; i++) {
+        unsigned char c = x->str[i];
+        x->str[i] = up ? toupper(c) : tolower(c);
+    }
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_upcase(lenv* e, lval* a) { return builtin_str_case(e, a, "upcase");}
+static lval* builtin_downcase(lenv* e, lval* a) { return builtin_str_case(e, a, "downcase");}
+
+//replaces each {} in the template by the next argument, {{ and }} stand
+//for braces of their own
+static lval* builtin_format(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count >= 1),
+            "Function 'format' passed incorrect number of arguments. Got %i, Expected at least 1.", a->count);
+    LASSERT_TYPE("format", a, 0, LVAL_STR);
+
+    lbuf* b = lbuf_new();
+    int next = 1, holes = 0;
+    for (char* c = a->cell[0]->str; *c; c++) {
+        if((c[0] == '{' && c[1] == '{') || (c[0] == '}' && c[1] == '}')){
+            lbuf_putc(b, *c++);
+        }else if(c[0] == '{' && c[1] == '}'){
+            if(next < a->count) { lval_display(b, a->cell[next++]);}
+            holes++;
+            c++;
+        }else{
+            lbuf_putc(b, *c);
+        }
+    }
+
+    lval* err = NULL;
+    if(holes != a->count - 1){
+        err = lval_err("Function 'format' passed %i values for %i placeholders.", a->count - 1, holes);
+    }
+    lval_del(a);
+    if(err) { lbuf_del(b); return err;}
+    return lval_buf_str(b);
+}
+
+static lval* builtin_sb_new(lenv* e, lval* a)
+{
+    lval* x = lval_alloc(LVAL_BUF);
+    x->buf = lbuf_new();
+    for (int i = 0; i < a->count; i++) { lval_display(x->buf, a->cell[i]);}
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_sb_append(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count >= 1),
+            "Function 'sb-append' passed incorrect number of arguments. Got %i, Expected at least 1.", a->count);
+    LASSERT_TYPE("sb-append", a, 0, LVAL_BUF);
+
+    for (int i = 1; i < a->count; i++) { lval_display(a->cell[0]->buf, a->cell[i]);}
+    return lval_take(a, 0);
+}
+
+static lval* builtin_sb_string(lenv* e, lval* a)
+{
+    LASSERT_NUM("sb-string", a, 1);
+    LASSERT_TYPE("sb-string", a, 0, LVAL_BUF);
+
+    lval* x = lval_str_n(a->cell[0]->buf->s, a->cell[0]->buf->len);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_sb_len(lenv* e, lval* a)
+{
+    LASSERT_NUM("sb-len", a, 1);
+    LASSERT_TYPE("sb-len", a, 0, LVAL_BUF);
+
+    lval* x = lval_num(a->cell[0]->buf->len);
+    lval_del(a);
+    return x;
+}
+
+static inline lval* builtin_cmp(lenv* e, lval* a, int op)
+{
+    LASSERT_NUM(lop_names[op], a, 2);
+    int r = lval_eq(a->cell[0], a->cell[1]);
+    if(op == OP_NE) { r = !r;}
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {return builtin_cmp(e, a, OP_EQ);}
+lval* builtin_ne(lenv* e, lval* a) {return builtin_cmp(e, a, OP_NE);}
+
+lval* builtin_print(lenv* e, lval*a)
+{
+    //print each argument follow by a space
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]);
+        putchar(' ');
+    }
+    
+    //print a newline and delete arguments
+    putchar('\n');
+    lval_del(a);
+    
+    return lval_sexpr();
+}
+
+lval* builtin_load(lenv* e, lval*a)
+{
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    mpc_result_t r;
+    if(mpc_parse_contents(a->cell[0]->str, Lispy, &r)){
+        //Read contents
+        lval* expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+
+        //Evaluate each expression
+        while(expr->count){
+            lval* x = lval_eval(e, lmacro_expand(e, lval_pop(expr, 0), 0));
+            if(x->type == LVAL_ERR) { lval_println(x);}
+            lval_del(x);
+        }
+        
+        lval_del(expr);
+        lval_del(a);
+        
+        return lval_sexpr();
+    }else {
+        //Get parse error as string
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+
+        //create new error message using it
+        lval* err = lval_err("Could not load Library %s", err_msg);
+        free(err_msg);
+        lval_del(a);
+
+        return err;
+    }
+}
+
+static lval* builtin_head(lenv* e, lval* a)
+{
+    LASSERT_NUM("head", a, 1);
+    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count != 0), "Function 'head' passed {}!");
+ 
+    lval* v = lval_own(lval_take(a, 0));
+    
+    //delete all elements that are not head
+    while(v->count > 1) {lval_del(lval_pop(v,1));}
+    
+    return v;
+}
+
+static lval* builtin_tail(lenv* e, lval* a)
+{
+    LASSERT_NUM("tail", a, 1);
+    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!");
+    
+    lval* v = lval_own(lval_take(a, 0));
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+static lval* builtin_init(lenv* e, lval* a)
+{
+    LASSERT_NUM("init", a, 1);
+    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count != 0), "Function 'init' passed {}!");
+    
+    lval* x = lval_own(lval_take(a, 0));
+    lval_del(lval_pop(x, x->count - 1));
+    return x;
+}
+
+static lval* builtin_len(lenv* e, lval* a)
+{
+    LASSERT_NUM("len", a, 1);
+    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+    
+    lval* x = lval_num(a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_cons(lenv* e, lval* a)
+{
+    LASSERT_NUM("cons", a, 2);
+    LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+    
+    lval* x = lval_own(lval_pop(a, 1));
+    x = lval_add_front(x, lval_take(a, 0)); 
+    return x;
+}
+
+static lval* builtin_list(lenv* e, lval* a)
+{
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+static lval* builtin_eval(lenv* e, lval* a)
+{
+    LASSERT_NUM("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+    
+    lval* x = lval_own(lval_take(a,0));
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+}
+
+//the arguments have been evaluated in order already
+static lval* builtin_do(lenv* e, lval* a)
+{
+    if(a->count == 0) { lval_del(a); return lval_qexpr();}
+    return lval_take(a, a->count - 1);
+}
+
+static lval* builtin_let(lenv* e, lval* a)
+{
+    LASSERT_NUM("let", a, 1);
+    LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+    //the scope lives on the stack, only its bindings are allocated
+    lenv l;
+    lenv_init(&l);
+    l.par = e;
+    lval* r = builtin_eval(&l, a);
+    lenv_clear(&l);
+    return r;
+}
+
+// Loops
+//
+// A loop binds its variables once in a frame of its own and evaluates its
+// body there. 'recur' hands back the values of the next iteration, which
+// replace the old ones in place, so looping costs neither stack nor a new
+// environment per step.
+
+static int lloop_depth = 0;
+
+static lval* builtin_loop(lenv* e, lval* a)
+{
+    LASSERT(a, a->count >= 2,
+            "Function 'loop' passed incorrect number of arguments. Got %i, Expected at least 2.", a->count);
+    LASSERT_TYPE("loop", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("loop", a, a->count-1, LVAL_QEXPR);
+
+    lval* syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function 'loop' cannot bind non-symbol!");
+        LASSERT(a, !lenv_sealed(e, syms->cell[i]->sym),
+                "Cannot redefine sealed symbol '%s'!", syms->cell[i]->sym);
+        for (int j = 0; j < i; j++) {
+            LASSERT(a, strcmp(syms->cell[i]->sym, syms->cell[j]->sym) != 0,
+                    "Function 'loop' cannot bind symbol '%s' twice!", syms->cell[i]->sym);
+        }
+    }
+    LASSERT(a, (syms->count == a->count-2), "Function 'loop' cannot bind incorrect number of values to symbols!");
+
+    //variable i lives in slot i of the frame from here on
+    lenv* l = lenv_new();
+    l->par = e;
+    for (int i = 0; i < syms->count; i++) { lenv_put(l, syms->cell[i], a->cell[i+1]);}
+    lval* body = lval_pop(a, a->count-1);
+    int n = syms->count;
+
+    lval* r;
+    lloop_depth++;
+    while(1){
+        lval* x = lval_own(lval_copy(body));
+        x->type = LVAL_SEXPR;
+        r = lval_eval(l, x);
+        if(r->type != LVAL_RECUR) { break;}
+
+        //the body may have bound more symbols in the frame with '='
+        if(r->count != n){
+            lval* err = lval_err("Function 'recur' passed incorrect number of arguments. Got %i, Expected %i.",
+                                 r->count, n);
+            lval_del(r);
+            r = err;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            lval_del(l->vals[i]);
+            l->vals[i] = r->cell[i];
+        }
+        r->count = 0;
+        lval_del(r);
+    }
+    lloop_depth--;
+
+    lenv_del(l);
+    lval_del(body);
+    lval_del(a);
+    return r;
+}
+
+static lval* builtin_recur(lenv* e, lval* a)
+{
+    LASSERT(a, lloop_depth > 0, "Function 'recur' used outside of a loop!");
+    a->type = LVAL_RECUR;
+    return a;
+}
+
+static lval* lval_join(lval* x, lval* y)
+{
+    y = lval_own(y);
+
+    // for each cell in 'y' add it to 'x'
+    while(y->count){
+        x = lval_add(x, lval_pop(y, 0));
+    }
+    
+    // delete the empty 'y' and return 'x'
+    lval_del(y);
+    return x;
+}
+
+static lval* builtin_join(lenv* e, lval* a)
+{
+    for(int i = 0; i < a->count; i++) {LASSERT_TYPE("join", a, i, LVAL_QEXPR);}
+    
+    lval* x = lval_own(lval_pop(a, 0));
+    
+    while(a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+    
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_error(lenv* e, lval* a)
+{
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+    //the text is the message, never a format
+    lval* err = lval_err_text(a->cell[0]->str);
+
+    lval_del(a);
+    return err;
+}
+
+static lval* lval_apply(lenv* e, lval* f, lval* a);
+
+//evaluates the body and hands the message of an error in it to the handler
+static lval* builtin_try(lenv* e, lval* a)
+{
+    LASSERT_NUM("try", a, 2);
+    LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("try", a, 1, LVAL_FUN);
+
+    lval* x = lval_own(lval_pop(a, 0));
+    x->type = LVAL_SEXPR;
+
+    lunwind u;
+    u.roots = lroot_count;
+    u.frames = lframe_count;
+    u.prev = lcatch;
+    lval* r;
+    if(setjmp(u.jmp) == 0){
+        lcatch = &u;
+        r = lval_eval(e, x);
+    }else{
+        r = lthrown;
+        lthrown = NULL;
+    }
+    lcatch = u.prev;
+
+    if(r->type != LVAL_ERR){
+        lval_del(a);
+        return r;
+    }
+    lval* msg = lval_str(lerr_text(r));
+    lval_del(r);
+    r = lval_apply(e, a->cell[0], lval_add(lval_sexpr(), msg));
+    lval_del(a);
+    return r;
+}
+
+static void lenv_touch(lenv* e, lval* k, lval* v);
+
+static lval* builtin_var(lenv* e, lval* a, char* func)
+{
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+    
+    //first element is symbol list
+    lval* syms = a->cell[0];
+
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function 'def' cannot define non-symbol!");
+        LASSERT(a, !lenv_sealed(e, syms->cell[i]->sym),
+                "Cannot redefine sealed symbol '%s'!", syms->cell[i]->sym);
+    }
+
+    //check correct number of symbols and values
+    LASSERT(a, (syms->count == a->count-1), "Function 'def' cannot define incorrect number of values to symbols!");
+
+    lenv* g = e;
+    while(g->par){g = g->par;}
+
+    for (int i = 0; i < syms->count; i++) {
+        if(strcmp(func, "def") == 0 || e == g) {lenv_touch(g, syms->cell[i], a->cell[i+1]);}
+        if(strcmp(func, "def") == 0) {lenv_def(e, syms->cell[i], a->cell[i+1]);}
+        if(strcmp(func, "=")== 0) {lenv_put(e, syms->cell[i], a->cell[i+1]);}
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_def(lenv*e, lval* a) {return builtin_var(e, a, "def");}
+lval* builtin_put(lenv*e, lval* a) {return builtin_var(e, a, "=");}
+
+static lval* builtin_seal(lenv* e, lval* a)
+{
+    LASSERT_NUM("seal", a, 1);
+    LASSERT_TYPE("seal", a, 0, LVAL_QEXPR);
+
+    while(e->par){e = e->par;}
+    lval* syms = a->cell[0];
+
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function 'seal' cannot seal non-symbol!");
+        LASSERT(a, lenv_find(e, syms->cell[i]->sym), "unbound symbol '%s'!", syms->cell[i]->sym);
+    }
+
+    for (int i = 0; i < syms->count; i++) {
+        for (int j = 0; j < e->count; j++) {
+            if(strcmp(e->syms[j], syms->cell[i]->sym) == 0 && !e->sealed[j]) { e->sealed[j] = 1; lenv_seals++;}
+        }
+    }
+
+    //functions may now fold what was just sealed
+    lenv_epoch++;
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+static lval* builtin_hashcons(lenv* e, lval* a)
+{
+    LASSERT_NUM("hashcons", a, 1);
+    LASSERT_TYPE("hashcons", a, 0, LVAL_NUM);
+
+    lval_hashcons = a->cell[0]->num != 0;
+    lval_del(a);
+    return lval_sexpr();
+}
+
+static lval* builtin_exit(lenv* e, lval* a)
+{
+    exit(EXIT_SUCCESS); 
+}
+
+lval* builtin_if(lenv* e, lval* a)
+{
+    LASSERT_NUM("if", a, 3); 
+    LASSERT_TYPE("if", a, 0, LVAL_NUM);  
+    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);  
+    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);  
+    
+    lval* x = lval_own(lval_pop(a, a->cell[0]->num ? 1 : 2));
+    lval_del(a);
+    
+    x->type = LVAL_SEXPR;
+    return lval_eval(e, x);
+}
+
+// Conditionals
+//
+// 'cond' evaluates the body of the first clause whose condition holds and
+// 'case' that of the first clause whose key equals its value, numbers and
+// doubles comparing by value. Conditions, keys and bodies are evaluated the
+// way 'fst' and 'snd' hand them out. The optimizer turns a 'case' on literal
+// keys other than doubles into one on a map from keys to bodies, which
+// finds its clause with a single lookup.
+
+#define CASE_TABLE_MIN 4
+
+static lval* lval_elem(lenv* e, lval* l, int i);
+
+static lval* builtin_cond(lenv* e, lval* a)
+{
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, (a->cell[i]->type == LVAL_QEXPR && a->cell[i]->count >= 2),
+                "Function 'cond' passed clause %i without a condition and a body.", i);
+    }
+
+    for (int i = 0; i < a->count; i++) {
+        lval* c = lval_elem(e, a->cell[i], 0);
+        if(c->type == LVAL_ERR) { lval_del(a); return c;}
+        if(c->type != LVAL_NUM){
+            lval* err = lval_err("Function 'cond' passed condition of type %s in clause %i. Expected %s.",
+                                 ltype_name(c->type), i, ltype_name(LVAL_NUM));
+            lval_del(c); lval_del(a);
+            return err;
+        }
+
+        int hit = c->num != 0;
+        lval_del(c);
+        if(hit){
+            lval* r = lval_elem(e, a->cell[i], 1);
+            lval_del(a);
+            return r;
+        }
+    }
+    lval_del(a);
+    return lval_err("No Selection Found");
+}
+
+//keys match like '==', except that a double matches a number of equal value
+static int lcase_eq(lval* x, lval* k)
+{
+    int xn = x->type == LVAL_NUM || x->type == LVAL_DBL || x->type == LVAL_BIG;
+    int kn = k->type == LVAL_NUM || k->type == LVAL_DBL || k->type == LVAL_BIG;
+    if(xn && kn && (x->type == LVAL_DBL || k->type == LVAL_DBL)){
+        return lval_to_dbl(x) == lval_to_dbl(k);
+    }
+    return lval_eq(x, k);
+}
+
+static lval* builtin_case(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count >= 1),
+            "Function 'case' passed incorrect number of arguments. Got %i, Expected at least 1.", a->count);
+    lval* x = a->cell[0];
+
+    //a table made by the optimizer, it holds no double keys but a double
+    //can still match a number key, so those look at each key in order
+    if(a->count == 2 && a->cell[1]->type == LVAL_MAP){
+        lmap* m = a->cell[1]->map;
+        lval* b = NULL;
+        if(x->type == LVAL_DBL){
+            for (int i = 0; i < m->used && !b; i++) {
+                lmap_entry* n = &m->entries[i];
+                if(n->key && lcase_eq(x, n->key)) { b = n->val;}
+            }
+        }else{
+            b = lmap_get(m, x);
+        }
+        lval* r = b ? lval_eval(e, lval_copy(b)) : lval_err("No Case Found");
+        lval_del(a);
+        return r;
+    }
+
+    for (int i = 1; i < a->count; i++) {
+        LASSERT(a, (a->cell[i]->type == LVAL_QEXPR && a->cell[i]->count >= 2),
+                "Function 'case' passed clause %i without a key and a body.", i);
+    }
+
+    for (int i = 1; i < a->count; i++) {
+        lval* k = lval_elem(e, a->cell[i], 0);
+        if(k->type == LVAL_ERR) { lval_del(a); return k;}
+
+        int hit = lcase_eq(x, k);
+        lval_del(k);
+        if(hit){
+            lval* r = lval_elem(e, a->cell[i], 1);
+            lval_del(a);
+            return r;
+        }
+    }
+    lval_del(a);
+    return lval_err("No Case Found");
+}
+
+// Pattern matching
+//
+// 'match' takes clauses of a pattern and a body. Numbers and strings match
+// themselves, '_' matches anything, other symbols bind what they match and
+// lists match lists element by element, with '& xs' binding the elements
+// left over. The patterns are compiled into a decision tree: each inner
+// node runs one test, and clauses that share it are settled by it
+// together. Overlapping clauses can make the tree grow exponentially, so
+// past LPAT_MAX_NODES it is given up and the clauses are tried one by one.
+// Bodies run in a scope of their own holding the bindings. The optimizer
+// compiles the patterns in function bodies once.
+
+#define LPAT_MAX_DEPTH 64
+#define LPAT_MAX_NODES 4096
+
+static void lpnode_del(lpnode* x)
+{
+    if(!x) { return;}
+    lpnode_del(x->yes);
+    lpnode_del(x->no);
+    free(x);
+}
+
+static void lmatch_del(lmatch* m)
+{
+    if(--m->refs) { return;}
+
+    for (int i = 0; i < m->count; i++) {
+        lpclause* c = &m->clauses[i];
+        for (int j = 0; j < c->ntests; j++) {
+            free(c->tests[j].path);
+            if(c->tests[j].lit) { lval_del(c->tests[j].lit);}
+        }
+        for (int j = 0; j < c->nbinds; j++) {
+            free(c->binds[j].path);
+            lval_del(c->binds[j].sym);
+        }
+        free(c->tests);
+        free(c->binds);
+        //clauses after one that failed to compile were never filled in
+        if(c->body) { lval_del(c->body);}
+    }
+    lpnode_del(m->root);
+    free(m->clauses);
+    free(m);
+}
+
+static int* lpat_path(int* path, int depth)
+{
+    int* p = malloc(sizeof(int) * (depth + 1));
+    memcpy(p, path, sizeof(int) * depth);
+    return p;
+}
+
+static void lpat_test(lpclause* c, int kind, int* path, int depth, long n, lval* lit)
+{
+    c->tests = realloc(c->tests, sizeof(lptest) * (c->ntests + 1));
+    lptest* t = &c->tests[c->ntests++];
+    t->kind = kind;
+    t->depth = depth;
+    t->path = lpat_path(path, depth);
+    t->n = n;
+    t->lit = lit;
+}
+
+static lval* lpat_bind(lenv* e, lpclause* c, lval* sym, int* path, int depth, int rest)
+{
+    if(strcmp(sym->sym, "_") == 0) { return NULL;}
+    if(lenv_sealed(e, sym->sym)) { return lval_err("Cannot redefine sealed symbol '%s'!", sym->sym);}
+    for (int i = 0; i < c->nbinds; i++) {
+        if(strcmp(c->binds[i].sym->sym, sym->sym) == 0){
+            return lval_err("Function 'match' cannot bind symbol '%s' twice!", sym->sym);
+        }
+    }
+
+    c->binds = realloc(c->binds, sizeof(lpbind) * (c->nbinds + 1));
+    lpbind* b = &c->binds[c->nbinds++];
+    b->sym = lval_copy(sym);
+    b->depth = depth;
+    b->path = lpat_path(path, depth);
+    b->rest = rest;
+    return NULL;
+}
+
+//adds the tests and bindings of pattern 'p', found at 'path' in the value,
+//to 'c', giving an error if 'p' is not a pattern
+static lval* lpat_compile(lenv* e, lpclause* c, lval* p, int* path, int depth)
+{
+    switch(p->type){
+    case LVAL_NUM: case LVAL_DBL: case LVAL_BIG: case LVAL_STR:
+        lpat_test(c, LPAT_EQ, path, depth, 0, lval_copy(p));
+        return NULL;
+    case LVAL_SYM:
+        return lpat_bind(e, c, p, path, depth, -1);
+    case LVAL_QEXPR: break;
+    default:
+        return lval_err("Function 'match' passed pattern of type %s.", ltype_name(p->type));
+    }
+
+    int n = p->count, rest = -1;
+    for (int i = 0; i < n; i++) {
+        if(p->cell[i]->type != LVAL_SYM || strcmp(p->cell[i]->sym, "&") != 0) { continue;}
+        if(i != n - 2 || p->cell[n-1]->type != LVAL_SYM){
+            return lval_err("Pattern format invalid. Symbol '&' not followed by single symbol.");
+        }
+        rest = i;
+    }
+    if(depth == LPAT_MAX_DEPTH) { return lval_err("Function 'match' passed pattern nested too deeply!");}
+
+    lpat_test(c, rest < 0 ? LPAT_LEN : LPAT_MIN, path, depth, rest < 0 ? n : rest, NULL);
+    for (int i = 0; i < (rest < 0 ? n : rest); i++) {
+        path[depth] = i;
+        lval* err = lpat_compile(e, c, p->cell[i], path, depth + 1);
+        if(err) { return err;}
+    }
+    return rest < 0 ? NULL : lpat_bind(e, c, p->cell[n-1], path, depth, rest);
+}
+
+//what 't' coming out 'yes' says of 'u': 1 it passes, 0 it fails, -1 unknown
+static int lptest_implies(lptest* t, int yes, lptest* u)
+{
+    if(t->depth != u->depth || memcmp(t->path, u->path, sizeof(int) * t->depth)) { return -1;}
+    if(t->kind == u->kind && t->n == u->n && (t->kind != LPAT_EQ || lval_eq(t->lit, u->lit))) { return yes;}
+
+    if(!yes){
+        //fewer than n elements also rules out lists of n or more
+        return t->kind == LPAT_MIN && u->kind != LPAT_EQ && u->n >= t->n ? 0 : -1;
+    }
+
+    //literals are never lists, and a value equals only one of them
+    if(t->kind == LPAT_EQ || u->kind == LPAT_EQ) { return 0;}
+    if(t->kind == LPAT_LEN) { return u->kind == LPAT_MIN && t->n >= u->n;}
+    if(u->kind == LPAT_MIN) { return u->n <= t->n ? 1 : -1;}
+    return u->n < t->n ? 0 : -1;
+}
+
+//a clause and its tests not yet decided on the way to a node
+typedef struct {
+    int clause;
+    int count;
+    lptest** tests;
+} lprow;
+
+static lpnode* lpnode_build(lprow* rows, int n, int* budget);
+
+//the tree below 't' coming out 'yes', where rows it rules out are dropped
+//and tests it settles are no longer run
+static lpnode* lpnode_branch(lprow* rows, int n, lptest* t, int yes, int* budget)
+{
+    lprow* next = malloc(sizeof(lprow) * (n + 1));
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        lprow* r = &next[m];
+        r->clause = rows[i].clause;
+        r->count = 0;
+        r->tests = malloc(sizeof(lptest*) * (rows[i].count + 1));
+
+        int alive = 1;
+        for (int j = 0; j < rows[i].count && alive; j++) {
+            int k = lptest_implies(t, yes, rows[i].tests[j]);
+            if(k == 0) { alive = 0;}
+            if(k < 0) { r->tests[r->count++] = rows[i].tests[j];}
+        }
+        if(alive) { m++;}
+        else { free(r->tests);}
+    }
+
+    lpnode* x = lpnode_build(next, m, budget);
+    for (int i = 0; i < m; i++) { free(next[i].tests);}
+    free(next);
+    return x;
+}
+
+//the first row decides: with nothing left to test it is chosen, otherwise
+//its next test splits the rows. NULL once more than 'budget' nodes are made
+static lpnode* lpnode_build(lprow* rows, int n, int* budget)
+{
+    if(--*budget < 0) { return NULL;}
+
+    lpnode* x = malloc(sizeof(lpnode));
+    x->test = NULL;
+    x->clause = -1;
+    x->yes = x->no = NULL;
+
+    if(n == 0) { return x;}
+    if(rows[0].count == 0) { x->clause = rows[0].clause; return x;}
+
+    x->test = rows[0].tests[0];
+    x->yes = lpnode_branch(rows, n, x->test, 1, budget);
+    x->no = x->yes ? lpnode_branch(rows, n, x->test, 0, budget) : NULL;
+    if(!x->no) { lpnode_del(x); return NULL;}
+    return x;
+}
+
+//compiles the clauses of 'a' from 'from' on
+static lval* lval_match(lenv* e, lval* a, int from)
+{
+    for (int i = from; i < a->count; i++) {
+        lval* cl = a->cell[i];
+        if(cl->type != LVAL_QEXPR || cl->count < 2){
+            return lval_err("Function 'match' passed clause %i without a pattern and a body.", i - from);
+        }
+    }
+
+    lmatch* m = malloc(sizeof(lmatch));
+    m->refs = 1;
+    m->count = a->count - from;
+    m->clauses = calloc(m->count + 1, sizeof(lpclause));
+    m->root = NULL;
+
+    int path[LPAT_MAX_DEPTH];
+    for (int i = 0; i < m->count; i++) {
+        lpclause* c = &m->clauses[i];
+        c->body = lval_copy(a->cell[from + i]->cell[1]);
+        lval* err = lpat_compile(e, c, a->cell[from + i]->cell[0], path, 0);
+        if(err) { lmatch_del(m); return err;}
+    }
+
+    lprow* rows = malloc(sizeof(lprow) * (m->count + 1));
+    for (int i = 0; i < m->count; i++) {
+        rows[i].clause = i;
+        rows[i].count = m->clauses[i].ntests;
+        rows[i].tests = malloc(sizeof(lptest*) * (rows[i].count + 1));
+        for (int j = 0; j < rows[i].count; j++) { rows[i].tests[j] = &m->clauses[i].tests[j];}
+    }
+    int budget = LPAT_MAX_NODES;
+    m->root = lpnode_build(rows, m->count, &budget);
+    for (int i = 0; i < m->count; i++) { free(rows[i].tests);}
+    free(rows);
+
+    lval* x = lval_alloc(LVAL_MATCH);
+    x->match = m;
+    return x;
+}
+
+static lval* lpat_at(lval* v, int* path, int depth)
+{
+    for (int i = 0; i < depth; i++) { v = v->cell[path[i]];}
+    return v;
+}
+
+static int lptest_run(lptest* t, lval* v)
+{
+    v = lpat_at(v, t->path, t->depth);
+    switch(t->kind){
+    case LPAT_LEN: return v->type == LVAL_QEXPR && v->count == t->n;
+    case LPAT_MIN: return v->type == LVAL_QEXPR && v->count >= t->n;
+    default: return lval_eq(v, t->lit);
+    }
+}
+
+//the first clause all of whose tests pass, in the order they were made
+static int lmatch_scan(lmatch* m, lval* v)
+{
+    for (int i = 0; i < m->count; i++) {
+        lpclause* c = &m->clauses[i];
+        int j = 0;
+        while(j < c->ntests && lptest_run(&c->tests[j], v)) { j++;}
+        if(j == c->ntests) { return i;}
+    }
+    return -1;
+}
+
+static lval* lmatch_run(lenv* e, lmatch* m, lval* v)
+{
+    int k;
+    if(m->root){
+        lpnode* x = m->root;
+        while(x->test) { x = lptest_run(x->test, v) ? x->yes : x->no;}
+        k = x->clause;
+    }else{
+        k = lmatch_scan(m, v);
+    }
+    if(k < 0) { return lval_err("No Match Found");}
+
+    lpclause* c = &m->clauses[k];
+    lenv l;
+    lenv_init(&l);
+    l.par = e;
+    for (int i = 0; i < c->nbinds; i++) {
+        lpbind* b = &c->binds[i];
+        lval* p = lpat_at(v, b->path, b->depth);
+        if(b->rest < 0) { lenv_put(&l, b->sym, p); continue;}
+
+        //symbols of a pattern are distinct, so the binding is the last one
+        lval* nil = lval_qexpr();
+        lenv_put(&l, b->sym, nil);
+        lval_del(nil);
+        for (int j = b->rest; j < p->count; j++) { lval_add(l.vals[l.count-1], lval_copy(p->cell[j]));}
+    }
+
+    lval* r = lval_eval(&l, lval_copy(c->body));
+    lenv_clear(&l);
+    return r;
+}
+
+static lval* builtin_match(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count >= 2),
+            "Function 'match' passed incorrect number of arguments. Got %i, Expected at least 2.", a->count);
+
+    //patterns compiled by the optimizer
+    lval* m = a->count == 2 && a->cell[1]->type == LVAL_MATCH ? lval_pop(a, 1) : lval_match(e, a, 1);
+    if(m->type == LVAL_ERR) { lval_del(a); return m;}
+
+    lval* r = lmatch_run(e, m->match, a->cell[0]);
+    lval_del(m);
+    lval_del(a);
+    return r;
+}
+
+// Optimizer
+//
+// Calls to small sealed lambdas are replaced by their bodies with the
+// arguments substituted for the formals. Functions are dynamically scoped
+// here, so the substituted body sees exactly the environment the callee
+// would have, minus its own formals, and only a sealed name is sure to
+// mean the same function in every caller. The original body is kept, the
+// inlined one lives in 'code' and is redone on the next call once
+// lenv_epoch has moved, so defining a function costs nothing elsewhere.
+//
+// Symbols the user sealed can neither be redefined nor shadowed, so those
+// bound to constants are replaced by their values. Calls through sealed
+// names are resolved the same way: pure builtins on literals are folded,
+// 'if' or 'cond' on a constant keep one branch, 'case' on literal keys gets
+// a table and 'match' its decision tree. Nothing else is touched, since any
+// caller may rebind an unsealed name.
+
+#define INLINE_MAX_SIZE 16
+#define INLINE_MAX_DEPTH 4
+
+typedef struct {
+    lenv* env;      // global environment callees are resolved in
+    lval* shadow;   // symbols the body binds itself, never inlined
+    int opaque;     // body binds symbols we cannot see, leave it alone
+    int depth;
+} lopt;
+
+static int lval_size(lval* v)
+{
+    int n = 1;
+    if(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR){
+        for (int i = 0; i < v->count; i++) { n += lval_size(v->cell[i]);}
+    }
+    return n;
+}
+
+static int lval_count_sym(lval* v, char* sym)
+{
+    if(v->type == LVAL_SYM) { return strcmp(v->sym, sym) == 0;}
+    int n = 0;
+    if(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR){
+        for (int i = 0; i < v->count; i++) { n += lval_count_sym(v->cell[i], sym);}
+    }
+    return n;
+}
+
+static int lval_has_qexpr(lval* v)
+{
+    for (int i = 0; i < v->count; i++) {
+        if(v->cell[i]->type == LVAL_QEXPR) { return 1;}
+        if(v->cell[i]->type == LVAL_SEXPR && lval_has_qexpr(v->cell[i])) { return 1;}
+    }
+    return 0;
+}
+
+static int lval_binds(char* sym)
+{
+    return strcmp(sym, "def") == 0 || strcmp(sym, "=") == 0 
+        || strcmp(sym, "\\") == 0 || strcmp(sym, "fun") == 0
+        || strcmp(sym, "loop") == 0;
+}
+
+//collect the symbols a body binds with def, =, \, fun or loop
+static void lopt_scan(lopt* o, lval* v)
+{
+    if(v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return;}
+
+    if(v->count > 1 && v->cell[0]->type == LVAL_SYM && lval_binds(v->cell[0]->sym)){
+        if(v->cell[1]->type != LVAL_QEXPR){
+            o->opaque = 1;
+        }else{
+            for (int i = 0; i < v->cell[1]->count; i++) {
+                lval_add(o->shadow, lval_copy(v->cell[1]->cell[i]));
+            }
+        }
+    }
+
+    for (int i = 0; i < v->count; i++) { lopt_scan(o, v->cell[i]);}
+}
+
+//small, non-recursive and without nested Q-Expressions or binding forms,
+//so substituting arguments cannot change what they mean
+static int lval_inlinable(lval* f, char* name)
+{
+    if(f->type != LVAL_FUN || f->builtin || f->env->count || f->memo) { return 0;}
+    if(lval_count_sym(f->formals, "&") || lval_count_sym(f->body, name)) { return 0;}
+    if(lval_size(f->body) > INLINE_MAX_SIZE || lval_has_qexpr(f->body)) { return 0;}
+    return lval_count_sym(f->body, "def") + lval_count_sym(f->body, "=")
+        + lval_count_sym(f->body, "\\") + lval_count_sym(f->body, "fun") == 0;
+}
+
+static lval* lval_subst(lval* v, lval* formals, lval* args)
+{
+    if(v->type == LVAL_SYM){
+        for (int i = 0; i < formals->count; i++) {
+            if(strcmp(formals->cell[i]->sym, v->sym) == 0) { return lval_copy(args->cell[i]);}
+        }
+    }
+    if(v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return lval_copy(v);}
+
+    lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    for (int i = 0; i < v->count; i++) {
+        lval_add(x, lval_subst(v->cell[i], formals, args));
+    }
+    return x;
+}
+
+//walks 'v' the way it is evaluated: each formal must come up once and in
+//turn, all of them before any call nested in 'v' is made
+static int lopt_in_order(lval* v, lval* formals, int* next, int top)
+{
+    if(v->type == LVAL_SYM){
+        for (int i = 0; i < formals->count; i++) {
+            if(strcmp(formals->cell[i]->sym, v->sym) != 0) { continue;}
+            if(i != *next) { return 0;}
+            (*next)++;
+        }
+        return 1;
+    }
+    if(v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 1;}
+
+    for (int i = 0; i < v->count; i++) {
+        if(!lopt_in_order(v->cell[i], formals, next, 0)) { return 0;}
+    }
+    return top || *next == formals->count;
+}
+
+static lval* lopt_call(lopt* o, lval* v);
+
+//replace the call 'c' by the body of its function if that is safe
+static lval* lopt_inline(lopt* o, lval* c)
+{
+    if(o->depth >= INLINE_MAX_DEPTH || c->count == 0 || c->cell[0]->type != LVAL_SYM) { return c;}
+
+    //a caller may rebind any name that is not sealed while the body runs
+    char* name = c->cell[0]->sym;
+    if(lval_count_sym(o->shadow, name) || !lenv_sealed(o->env, name)) { return c;}
+
+    lval* f = lenv_find(o->env, name);
+    if(!f || !lval_inlinable(f, name) || f->formals->count != c->count - 1) { return c;}
+
+    //arguments with effects must be evaluated exactly once and in the
+    //order they are written, which 'and' and 'or' may not do
+    int effects = 0;
+    for (int i = 1; i < c->count; i++) { effects |= c->cell[i]->type == LVAL_SEXPR;}
+    if(effects){
+        int next = 0;
+        if(lval_count_sym(f->body, "and") || lval_count_sym(f->body, "or")) { return c;}
+        if(!lopt_in_order(f->body, f->formals, &next, 1) || next != f->formals->count) { return c;}
+    }
+
+    //what is left of 'c' after dropping the name are the arguments
+    lval_del(lval_pop(c, 0));
+    lval* x = lval_subst(f->body, f->formals, c);
+    x->type = c->type;
+    lval_del(c);
+
+    o->depth++;
+    lval* r = lopt_call(o, x);
+    o->depth--;
+
+    lval_del(x);
+    return r;
+}
+
+//value of a sealed symbol bound to a constant
+static lval* lopt_const(lopt* o, char* sym)
+{
+    if(lval_count_sym(o->shadow, sym) || !lenv_sealed(o->env, sym)) { return NULL;}
+    
+    lval* v = lenv_find(o->env, sym);
+    return v->type == LVAL_FUN ? NULL : v;
+}
+
+//Q-Expressions are data unless their caller is known to evaluate them,
+//they are left as written
+static lval* lopt_expr(lopt* o, lval* v)
+{
+    if(v->type == LVAL_SEXPR) { return lopt_call(o, v);}
+
+    lval* k = v->type == LVAL_SYM ? lopt_const(o, v->sym) : NULL;
+    return lval_copy(k ? k : v);
+}
+
+//the global function a call 'c' makes, optionally by 'name'. Like inlined
+//callees its name must be sealed, or a caller could rebind it
+static lval* lopt_callee(lopt* o, lval* c, char* name)
+{
+    if(c->count == 0 || c->cell[0]->type != LVAL_SYM) { return NULL;}
+    
+    char* sym = c->cell[0]->sym;
+    if(name && strcmp(sym, name) != 0) { return NULL;}
+    if(lval_count_sym(o->shadow, sym) || !lenv_sealed(o->env, sym)) { return NULL;}
+
+    lval* f = lenv_find(o->env, sym);
+    return f && f->type == LVAL_FUN ? f : NULL;
+}
+
+static int lopt_is_if(lopt* o, lval* v)
+{
+    if(v->count != 4) { return 0;}
+    lval* f = lopt_callee(o, v, NULL);
+    return f && f->builtin == builtin_if;
+}
+
+static int lval_pure(lbuiltin f)
+{
+    lbuiltin pure[] = {
+        builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+        builtin_gt, builtin_lt, builtin_ge, builtin_le, builtin_eq, builtin_ne,
+        builtin_list, builtin_head, builtin_tail, builtin_init, builtin_len,
+        builtin_cons, builtin_join,
+    };
+    
+    for (int i = 0; i < sizeof(pure) / sizeof(lbuiltin); i++) {
+        if(pure[i] == f) { return 1;}
+    }
+    return 0;
+}
+
+//replace the call 'c' by evaluating the cells of 'b' in its place
+static lval* lopt_splice(lval* c, lval* b)
+{
+    b = lval_own(b);
+    b->type = c->type;
+    lval_del(c);
+    
+    //'(x)' evaluates to the same as 'x'
+    if(b->type == LVAL_SEXPR && b->count == 1) { return lval_take(b, 0);}
+    return b;
+}
+
+//replace the call 'c' by a value computed in advance
+static lval* lopt_value(lval* c, lval* v)
+{
+    int type = c->type;
+    lval_del(c);
+    return type == LVAL_SEXPR ? v : lval_add(lval_qexpr(), v);
+}
+
+//the call 'c' on its first argument and the table 't' for its clauses
+static lval* lopt_dispatch(lval* c, lval* t)
+{
+    lval* x = lval_add(lval_sexpr(), lval_copy(c->cell[0]));
+    x->type = c->type;
+    lval_add(x, lval_copy(c->cell[1]));
+    lval_add(x, t);
+    lval_del(c);
+    return x;
+}
+
+static lval* lopt_fold(lopt* o, lval* c)
+{
+    lval* f;
+
+    //'if' on a constant keeps only the branch taken
+    if(lopt_is_if(o, c) && c->cell[1]->type == LVAL_NUM
+       && c->cell[2]->type == LVAL_QEXPR && c->cell[3]->type == LVAL_QEXPR){
+        return lopt_splice(c, lval_pop(c, c->cell[1]->num ? 2 : 3));
+    }
+
+    //'cond' drops clauses that can never be chosen and anything after a
+    //clause that always is
+    f = lopt_callee(o, c, NULL);
+    if(f && f->builtin == builtin_cond){
+        lval* x = lval_add(lval_sexpr(), lval_copy(c->cell[0]));
+        x->type = c->type;
+        
+        int i = 1;
+        for (; i < c->count; i++) {
+            lval* cl = c->cell[i];
+            if(cl->type != LVAL_QEXPR || cl->count < 2) { break;}
+            
+            lval* k = cl->cell[0];
+            k = k->type == LVAL_SYM ? lopt_const(o, k->sym) : k;
+            if(!k || k->type != LVAL_NUM) { lval_add(x, lval_copy(cl)); continue;}
+            if(k->num == 0) { continue;}
+
+            if(x->count == 1){
+                lval_del(x);
+                return lopt_splice(c, lval_add(lval_qexpr(), lval_copy(cl->cell[1])));
+            }
+            lval_add(x, lval_copy(cl));
+            i = c->count;
+        }
+        for (; i < c->count; i++) { lval_add(x, lval_copy(c->cell[i]));}
+        
+        lval_del(c);
+        return x;
+    }
+
+    //'case' on literal keys looks its clause up in a table
+    if(f && f->builtin == builtin_case && c->count - 2 >= CASE_TABLE_MIN){
+        lmap* m = lmap_new();
+        for (int i = 2; i < c->count; i++) {
+            lval* cl = c->cell[i];
+            int t = cl->type == LVAL_QEXPR && cl->count >= 2 ? cl->cell[0]->type : LVAL_SYM;
+            if(t != LVAL_NUM && t != LVAL_BIG && t != LVAL_STR && t != LVAL_QEXPR){
+                lmap_del(m);
+                return c;
+            }
+
+            //of clauses with equal keys the first is chosen
+            if(!lmap_get(m, cl->cell[0])) { lmap_put(m, lval_copy(cl->cell[0]), lval_copy(cl->cell[1]));}
+        }
+
+        return lopt_dispatch(c, lval_map(m));
+    }
+
+    //'match' compiles its patterns once
+    if(f && f->builtin == builtin_match && c->count >= 3){
+        lval* m = lval_match(o->env, c, 2);
+        if(m->type == LVAL_ERR) { lval_del(m); return c;}
+        return lopt_dispatch(c, m);
+    }
+
+    //pure builtins on literals
+    if(f && f->builtin && lval_pure(f->builtin)){
+        lval* args = lval_sexpr();
+        for (int i = 1; i < c->count; i++) {
+            int t = c->cell[i]->type;
+            if(t != LVAL_NUM && t != LVAL_DBL && t != LVAL_BIG && t != LVAL_STR && t != LVAL_QEXPR) { lval_del(args); return c;}
+            lval_add(args, lval_copy(c->cell[i]));
+        }
+        
+        lval* r = f->builtin(o->env, args);
+        if(r->type == LVAL_ERR) { lval_del(r); return c;}
+        return lopt_value(c, r);
+    }
+
+    return c;
+}
+
+//optimize 'v' as a call, either an S-Expression or a Q-Expression that is
+//going to be evaluated such as a function body or a branch of 'if'
+static lval* lopt_call(lopt* o, lval* v)
+{
+    int branches = lopt_is_if(o, v);
+    
+    lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    for (int i = 0; i < v->count; i++) {
+        lval* c = v->cell[i];
+        if(branches && i >= 2 && c->type == LVAL_QEXPR){
+            lval_add(x, lopt_call(o, c));
+        }else{
+            lval_add(x, lopt_expr(o, c));
+        }
+    }
+
+    lval* r = lopt_fold(o, x);
+    return r == x ? lopt_inline(o, x) : r;
+}
+
+static void lval_optimize(lenv* e, lval* f)
+{
+    while(e->par){e = e->par;}
+
+    lopt o = {e, lval_own(lval_copy(f->formals)), 0, 0};
+    lopt_scan(&o, f->body);
+
+    if(f->code){lval_del(f->code);}
+    f->code = o.opaque ? NULL : lopt_call(&o, f->body);
+    if(f->code && lval_eq(f->code, f->body)){
+        lval_del(f->code);
+        f->code = NULL;
+    }
+    f->body = lval_freeze(f->body);
+    if(f->code) { f->code = lval_freeze(f->code);}
+    f->epoch = lenv_epoch;
+
+    lval_del(o.shadow);
+}
+
+//a global binding is about to change, bodies inlined against it are stale
+static void lenv_touch(lenv* e, lval* k, lval* v)
+{
+    lval* old = lenv_find(e, k->sym);
+    if(v->type == LVAL_FUN || (old && old->type == LVAL_FUN)) { lenv_epoch++;}
+}
+
+static lval* builtin_lambda(lenv* e, lval* a)
+{
+    //check two arguments, each of which are Q-expression
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+    
+    //check first Q-expression contains only Symbols
+    for (int i = 0; i <  a->cell[0]->count; i++) {
+        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+                "Cannot define non-symbol. Got %s, Expected %s.",
+                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_QEXPR));
+        LASSERT(a, !lenv_sealed(e, a->cell[0]->cell[i]->sym),
+                "Cannot redefine sealed symbol '%s'!", a->cell[0]->cell[i]->sym);
+    }
+    lval* formals = lval_pop(a, 0);
+    lval* body = lmacro_expand(e, lval_pop(a, 0), 1);
+    lval_del(a);
+
+    lval* f = lval_lambda(formals, body);
+    lval_optimize(e, f);
+    return f;
+}
+
+// Macros
+//
+// A macro is a lambda handed the forms of its arguments as they are written,
+// returning the code to run in place of its call. Calls are expanded once,
+// when the expression holding them is loaded or the lambda whose body holds
+// them is created, and the expansion is kept instead of the call. Quoted
+// lists are data until they are evaluated, so calls in them, like those in
+// code built at run time, are expanded each time they are met.
+
+#define MACRO_MAX_DEPTH 64
+
+//the macro the list 'v' calls, by its global name or as a value, if any
+static lval* lmacro_of(lenv* e, lval* v)
+{
+    if((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->count == 0) { return NULL;}
+
+    lval* m = v->cell[0];
+    if(m->type == LVAL_SYM){
+        while(e->par) { e = e->par;}
+        m = lenv_find(e, m->sym);
+    }
+    return m && m->type == LVAL_FUN && m->macro ? m : NULL;
+}
+
+//whether 'v' holds a macro call in an evaluated position
+static int lmacro_has(lenv* e, lval* v)
+{
+    if(v->type != LVAL_SEXPR) { return 0;}
+    if(lmacro_of(e, v)) { return 1;}
+    for (int i = 0; i < v->count; i++) {
+        if(lmacro_has(e, v->cell[i])) { return 1;}
     }
     return 0;
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op)
+//errors in a macro reach its caller as values, like those of builtins
+static lval* lmacro_apply(lenv* e, lval* m, lval* a)
+{
+    lunwind* u = lcatch;
+    lcatch = NULL;
+    lval* r = lval_apply(e, m, a);
+    lcatch = u;
+    return r;
+}
+
+//the expansion of the call 'v' to 'm', a list of the same type as 'v'
+//unless an S-Expression expands to a single value
+static lval* lmacro_call(lenv* e, lval* m, lval* v)
+{
+    //'m' may be the head of 'v', or redefine itself while it runs
+    m = lval_copy(m);
+
+    int type = v->type;
+    v = lval_own(v);
+    lval_del(lval_pop(v, 0));
+    v->type = LVAL_SEXPR;
+
+    lval* r = lmacro_apply(e, m, v);
+    lval_del(m);
+
+    if(r->type == LVAL_SEXPR || r->type == LVAL_QEXPR){
+        r = lval_own(r);
+        r->type = type;
+        return r;
+    }
+    return type == LVAL_QEXPR ? lval_add(lval_qexpr(), r) : r;
+}
+
+//'v' with the macro calls in evaluated positions expanded: 'v' itself and
+//the S-Expressions among its elements, but nothing quoted. A Q-Expression
+//is only expanded as the 'body' of a lambda. Nodes without any calls are
+//kept as they are, shared or not
+static lval* lmacro_expand(lenv* e, lval* v, int body)
+{
+    if(v->type != LVAL_SEXPR && !(body && v->type == LVAL_QEXPR)) { return v;}
+
+    lval* m;
+    for (int depth = 0; (m = lmacro_of(e, v)); depth++) {
+        if(depth == MACRO_MAX_DEPTH){
+            lval* err = lval_err("Macro expansion nested more than %i deep!", MACRO_MAX_DEPTH);
+            int type = v->type;
+            lval_del(v);
+            return type == LVAL_QEXPR ? lval_add(lval_qexpr(), err) : err;
+        }
+        v = lmacro_call(e, m, v);
+    }
+    if(v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return v;}
+
+    for (int i = 0; i < v->count; i++) {
+        if(!lmacro_has(e, v->cell[i])) { continue;}
+        v = lval_own(v);
+        v->cell[i] = lmacro_expand(e, v->cell[i], 0);
+    }
+    return v;
+}
+
+//evaluates the call to 'm' with argument forms 'a' met while evaluating
+static lval* lmacro_eval(lenv* e, lval* m, lval* a)
+{
+    lval* x = lmacro_apply(e, m, a);
+    lval_del(m);
+    if(x->type == LVAL_QEXPR){
+        x = lval_own(x);
+        x->type = LVAL_SEXPR;
+    }
+    return lval_eval(e, lmacro_expand(e, x, 0));
+}
+
+static lval* builtin_defmacro(lenv* e, lval* a)
+{
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count > 0 && a->cell[0]->cell[0]->type == LVAL_SYM),
+            "Function 'defmacro' passed no symbol to define!");
+
+    lval* formals = lval_own(lval_pop(a, 0));
+    lval* name = lval_add(lval_qexpr(), lval_pop(formals, 0));
+    lval* f = builtin_lambda(e, lval_add(lval_add(lval_sexpr(), formals), lval_take(a, 0)));
+    if(f->type == LVAL_ERR) { lval_del(name); return f;}
+
+    f->macro = 1;
+    return builtin_def(e, lval_add(lval_add(lval_sexpr(), name), f));
+}
+
+// Memoization
+//
+// A memoized function keeps a table of argument lists it has been called
+// with and the results it returned, keyed by the structural hash of the
+// arguments and compared with lval_eq. Once the table is full the least
+// recently used entry makes room.
+
+#define MEMO_CAPACITY 1024
+#define MEMO_MAX_CAPACITY (1 << 24)
+
+static lmemo* lmemo_new(int capacity)
+{
+    lmemo* m = malloc(sizeof(lmemo));
+    m->refs = 1;
+    m->capacity = capacity;
+    m->count = 0;
+    m->hits = 0;
+    m->misses = 0;
+    m->size = 8;
+    while(m->size < capacity) { m->size *= 2;}
+    m->buckets = calloc(m->size, sizeof(lmemo_entry*));
+    m->newest = NULL;
+    m->oldest = NULL;
+    return m;
+}
+
+static void lmemo_del(lmemo* m)
+{
+    if(--m->refs) { return;}
+
+    lmemo_entry* x = m->newest;
+    while(x){
+        lmemo_entry* next = x->older;
+        lval_del(x->args); lval_del(x->result);
+        free(x);
+        x = next;
+    }
+    free(m->buckets);
+    free(m);
+}
+
+static void lmemo_unlink(lmemo* m, lmemo_entry* x)
+{
+    if(x->newer) { x->newer->older = x->older;} else { m->newest = x->older;}
+    if(x->older) { x->older->newer = x->newer;} else { m->oldest = x->newer;}
+}
+
+static void lmemo_push(lmemo* m, lmemo_entry* x)
+{
+    x->newer = NULL;
+    x->older = m->newest;
+    if(m->newest) { m->newest->newer = x;} else { m->oldest = x;}
+    m->newest = x;
+}
+
+static lval* lmemo_get(lmemo* m, lval* args, unsigned long hash)
+{
+    for (lmemo_entry* x = m->buckets[hash & (m->size - 1)]; x; x = x->chain) {
+        if(x->hash == hash && lval_eq(x->args, args)){
+            lmemo_unlink(m, x);
+            lmemo_push(m, x);
+            return x->result;
+        }
+    }
+    return NULL;
+}
+
+static void lmemo_put(lmemo* m, lval* args, unsigned long hash, lval* result)
+{
+    //evict the least recently used entry
+    if(m->count == m->capacity){
+        lmemo_entry* x = m->oldest;
+        lmemo_unlink(m, x);
+        
+        lmemo_entry** p = &m->buckets[x->hash & (m->size - 1)];
+        while(*p != x) { p = &(*p)->chain;}
+        *p = x->chain;
+        
+        lval_del(x->args); lval_del(x->result);
+        free(x);
+        m->count--;
+    }
+
+    lmemo_entry* x = malloc(sizeof(lmemo_entry));
+    x->hash = hash;
+    x->args = args;
+    x->result = result;
+    x->chain = m->buckets[hash & (m->size - 1)];
+    m->buckets[hash & (m->size - 1)] = x;
+    lmemo_push(m, x);
+    m->count++;
+}
+
+//only calls binding every formal are memoized, partial applications are not
+static int lmemo_applies(lval* f, lval* a)
+{
+    int n = f->formals->count;
+    if(f->env->count) { return 0;}
+    if(n >= 2 && strcmp(f->formals->cell[n-2]->sym, "&") == 0) { return a->count >= n - 2;}
+    return a->count == n;
+}
+
+static lval* lval_bind(lenv* e, lval* f, lval* a);
+
+static lval* lmemo_call(lenv* e, lval* f, lval* a)
+{
+    lmemo* m = f->memo;
+    unsigned long hash = lval_hash(a);
+    
+    lval* r = lmemo_get(m, a, hash);
+    if(r){
+        m->hits++;
+        lval_del(a);
+        return lval_copy(r);
+    }
+    m->misses++;
+
+    //call the function itself, past the table
+    lval* args = lval_copy(a);
+    lunwind* u = lcatch;
+    lcatch = NULL;
+    r = lval_bind(e, f, a);
+    lcatch = u;
+
+    if(r->type == LVAL_ERR){
+        lval_del(args);
+    }else{
+        lmemo_put(m, args, hash, lval_copy(r));
+    }
+    return r;
+}
+
+static lval* builtin_memo(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count == 1 || a->count == 2),
+            "Function 'memo' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+    LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+    LASSERT(a, (!a->cell[0]->builtin), "Function 'memo' passed builtin function!");
+    
+    int capacity = MEMO_CAPACITY;
+    if(a->count == 2){
+        LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+        LASSERT(a, (a->cell[1]->num > 0 && a->cell[1]->num <= MEMO_MAX_CAPACITY),
+                "Function 'memo' passed capacity %li. Expected 1 to %i.", a->cell[1]->num, MEMO_MAX_CAPACITY);
+        capacity = a->cell[1]->num;
+    }
+
+    lval* f = lval_own(lval_take(a, 0));
+    if(f->memo) { lmemo_del(f->memo);}
+    f->memo = lmemo_new(capacity);
+    return f;
+}
+
+static lval* builtin_memo_stats(lenv* e, lval* a)
+{
+    LASSERT_NUM("memo-stats", a, 1);
+    LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+    LASSERT(a, (a->cell[0]->memo != NULL), "Function 'memo-stats' passed function that is not memoized!");
+
+    lmemo* m = a->cell[0]->memo;
+    lval* x = lval_qexpr();
+    lval_add(x, lval_num(m->hits));
+    lval_add(x, lval_num(m->misses));
+    lval_add(x, lval_num(m->count));
+    lval_add(x, lval_num(m->capacity));
+
+    lval_del(a);
+    return x;
+}
+
+lval* lval_call(lenv* e, lval* f, lval*a)
+{
+    //if builtin then simply call that, errors are thrown through those
+    //that hold nothing of their own while evaluating
+    if(f->builtin){
+        if(f->builtin == builtin_eval || f->builtin == builtin_if) { return f->builtin(e, a);}
+        lunwind* u = lcatch;
+        lcatch = NULL;
+        lval* r = f->builtin(e, a);
+        lcatch = u;
+        return r;
+    }
+    
+    //memoized functions answer repeated calls from their table
+    if(f->memo && lmemo_applies(f, a)) {return lmemo_call(e, f, a);}
+    return lval_bind(e, f, a);
+}
+
+//bind the arguments to the formals of 'f' in a frame of their own, on top
+//of those a partial application bound already. 'f' itself is left as it is
+static lval* lval_bind(lenv* e, lval* f, lval* a)
+{
+    lval** formals = f->formals->cell;
+    int total = f->formals->count;
+    int i = 0;
+
+    lenv l;
+    lenv_init(&l);
+    for (int k = 0; k < f->env->count; k++) { lenv_set(&l, f->env->syms[k], f->env->vals[k]);}
+
+    lval* err = NULL;
+    for (int j = 0; j < a->count && !err; j++, i++) {
+        //if we've ran out of formal arguments to bind
+        if(i == total){
+            err = lval_err("Function passed too many arguments. Got %i, Expected %i", a->count, total);
+        }else if(strcmp(formals[i]->sym, "&") == 0){
+            //'&' takes the remaining arguments as a list
+            if(i + 2 != total){
+                err = lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+                break;
+            }
+            lval* rest = lval_qexpr();
+            for (; j < a->count; j++) { lval_add(rest, lval_copy(a->cell[j]));}
+            lenv_set(&l, formals[i+1]->sym, rest);
+            lval_del(rest);
+            i = total;
+            break;
+        }else{
+            lenv_set(&l, formals[i]->sym, a->cell[j]);
+        }
+    }
+    lval_del(a);
+
+    //if '&' remains in formal list it should be bound to empty list
+    if(!err && i < total && strcmp(formals[i]->sym, "&") == 0){
+        if(i + 2 != total){
+            err = lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+        }else{
+            lval* val = lval_qexpr();
+            lenv_set(&l, formals[i+1]->sym, val);
+            lval_del(val);
+            i = total;
+        }
+    }
+
+    if(err) { lenv_clear(&l); return err;}
+
+    //if all formals have been bound evalute
+    if(i == total){
+        l.par = e;
+
+        //run the inlined body, redone first if a global it relied on has
+        //changed since
+        if(f->epoch != lenv_epoch) { lval_optimize(e, f);}
+        lval* body = f->code ? f->code : f->body;
+        lframe_push(&l);
+        lval* r = builtin_eval(&l, lval_add(lval_sexpr(), lval_copy(body)));
+        lframe_count--;
+        lenv_clear(&l);
+        return r;
+    }
+
+    //otherwise return partially evaluted function, which does not answer
+    //the same calls as a memoized one
+    lval* rest = lval_qexpr();
+    for (; i < total; i++) { lval_add(rest, lval_copy(formals[i]));}
+    lval* x = lval_lambda(rest, lval_copy(f->body));
+    x->code = f->code ? lval_copy(f->code) : NULL;
+    x->epoch = f->epoch;
+    *x->env = l;  // the frame is its environment from now on
+    return x;
+}
+
+//call 'f' without giving it up, for builtins calling back into functions
+static lval* lval_apply(lenv* e, lval* f, lval* a)
+{
+    if(f->builtin) { return lval_not_recur(f->builtin(e, a));}
+    return lval_not_recur(lval_call(e, f, a));
+}
+
+// List library
+//
+// Natives for the list functions of the prelude. Like 'fst' they evaluate
+// the elements they hand out and they fail the same way on lists that run
+// out early.
+
+static lval* lval_elem(lenv* e, lval* l, int i)
+{
+    return lval_eval(e, lval_copy(l->cell[i]));
+}
+
+static lval* builtin_nth(lenv* e, lval* a)
+{
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    long n = a->cell[0]->num;
+    lval* l = a->cell[1];
+    LASSERT(a, (n >= 0 && n <= l->count), "Function 'tail' passed {}!");
+    LASSERT(a, (n < l->count), "Function 'head' passed {}!");
+
+    lval* x = lval_elem(e, l, n);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_last(lenv* e, lval* a)
+{
+    LASSERT_NUM("last", a, 1);
+    LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!");
+
+    lval* x = lval_elem(e, a->cell[0], a->cell[0]->count - 1);
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_map(lenv* e, lval* a)
+{
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* x = lval_qexpr();
+
+    for (int i = 0; i < l->count; i++) {
+        lval* v = lval_elem(e, l, i);
+        if(v->type != LVAL_ERR) { v = lval_apply(e, f, lval_add(lval_sexpr(), v));}
+        if(v->type == LVAL_ERR) { lval_del(x); x = v; break;}
+        lval_add(x, v);
+    }
+
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_filter(lenv* e, lval* a)
+{
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* x = lval_qexpr();
+
+    for (int i = 0; i < l->count; i++) {
+        lval* v = lval_elem(e, l, i);
+        if(v->type != LVAL_ERR) { v = lval_apply(e, f, lval_add(lval_sexpr(), v));}
+        if(v->type != LVAL_ERR && v->type != LVAL_NUM){
+            lval* err = lval_err("Function 'if' passed incorrect type for argument 0. Got %s, Expected %s.",
+                                 ltype_name(v->type), ltype_name(LVAL_NUM));
+            lval_del(v);
+            v = err;
+        }
+        if(v->type == LVAL_ERR) { lval_del(x); x = v; break;}
+
+        if(v->num) { lval_add(x, lval_copy(l->cell[i]));}
+        lval_del(v);
+    }
+
+    lval_del(a);
+    return x;
+}
+
+static lval* builtin_reverse(lenv* e, lval* a)
 {
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if(strcmp(op, "==") == 0) {r = lval_eq(a->cell[0], a->cell[1]);}
-    if(strcmp(op, "!=") == 0) {r = !lval_eq(a->cell[0], a->cell[1]);}
+    LASSERT_NUM("reverse", a, 1);
+    LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    lval* x = lval_qexpr();
+    for (int i = l->count - 1; i >= 0; i--) { lval_add(x, lval_copy(l->cell[i]));}
+
     lval_del(a);
-    return lval_num(r);
+    return x;
 }
 
-lval* builtin_eq(lenv* e, lval* a) {return builtin_cmp(e, a, "==");}
-lval* builtin_ne(lenv* e, lval* a) {return builtin_cmp(e, a, "!=");}
-
-lval* builtin_print(lenv* e, lval*a)
+static lval* builtin_foldl(lenv* e, lval* a)
 {
-    //print each argument follow by a space
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]);
-        putchar(' ');
+    LASSERT_NUM("foldl", a, 3);
+    LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+    lval* z = lval_copy(a->cell[1]);
+
+    for (int i = 0; i < l->count; i++) {
+        lval* v = lval_elem(e, l, i);
+        if(v->type == LVAL_ERR) { lval_del(z); z = v; break;}
+        z = lval_apply(e, f, lval_add(lval_add(lval_sexpr(), z), v));
+        if(z->type == LVAL_ERR) { break;}
     }
-    
-    //print a newline and delete arguments
-    putchar('\n');
+
     lval_del(a);
-    
-    return lval_sexpr();
+    return z;
 }
 
-lval* builtin_load(lenv* e, lval*a)
+static lval* builtin_foldr(lenv* e, lval* a)
 {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-    mpc_result_t r;
-    if(mpc_parse_contents(a->cell[0]->str, Lispy, &r)){
-        //Read contents
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    LASSERT_NUM("foldr", a, 3);
+    LASSERT_TYPE("foldr", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldr", a, 2, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+
+    //elements are evaluated front to back before folding from the back
+    lval* vs = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        lval* v = lval_elem(e, l, i);
+        if(v->type == LVAL_ERR) { lval_del(vs); lval_del(a); return v;}
+        lval_add(vs, v);
+    }
 
-        //Evaluate each expression
-        while(expr->count){
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            if(x->type == LVAL_ERR) { lval_println(x);}
-            lval_del(x);
-        }
-        
-        lval_del(expr);
-        lval_del(a);
-        
-        return lval_sexpr();
-    }else {
-        //Get parse error as string
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+    lval* z = lval_copy(a->cell[1]);
+    while(vs->count){
+        z = lval_apply(e, f, lval_add(lval_add(lval_sexpr(), lval_pop(vs, vs->count - 1)), z));
+        if(z->type == LVAL_ERR) { break;}
+    }
 
-        //create new error message using it
-        lval* err = lval_err("Could not load Library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+    lval_del(vs);
+    lval_del(a);
+    return z;
+}
 
-        return err;
+//the first 'n' elements of 'l' and the rest of them
+static lval* lval_split(lval* l, long n, int front)
+{
+    lval* x = lval_qexpr();
+    for (long i = front ? 0 : n; i < (front ? n : l->count); i++) {
+        lval_add(x, lval_copy(l->cell[i]));
     }
+    return x;
 }
 
-static lval* builtin_head(lenv* e, lval* a)
+static lval* builtin_take(lenv* e, lval* a)
 {
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT(a, (a->cell[0]->count != 0), "Function 'head' passed {}!");
- 
-    lval* v = lval_take(a, 0);
-    
-    //delete all elements that are not head
-    while(v->count > 1) {lval_del(lval_pop(v,1));}
-    
-    return v;
+    LASSERT_NUM("take", a, 2);
+    LASSERT_TYPE("take", a, 0, LVAL_NUM);
+    LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->num >= 0 && a->cell[0]->num <= a->cell[1]->count), "Function 'head' passed {}!");
+
+    lval* x = lval_split(a->cell[1], a->cell[0]->num, 1);
+    lval_del(a);
+    return x;
 }
 
-static lval* builtin_tail(lenv* e, lval* a)
+static lval* builtin_drop(lenv* e, lval* a)
 {
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!");
-    
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+    LASSERT_NUM("drop", a, 2);
+    LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+    LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->num >= 0 && a->cell[0]->num <= a->cell[1]->count), "Function 'tail' passed {}!");
+
+    lval* x = lval_split(a->cell[1], a->cell[0]->num, 0);
+    lval_del(a);
+    return x;
 }
 
-static lval* builtin_init(lenv* e, lval* a)
+static lval* builtin_split(lenv* e, lval* a)
 {
-    LASSERT_NUM("init", a, 1);
-    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-    LASSERT(a, (a->cell[0]->count != 0), "Function 'init' passed {}!");
-    
-    lval* x = lval_take(a, 0);
-    lval_del(lval_pop(x, x->count - 1));
+    LASSERT_NUM("split", a, 2);
+    LASSERT_TYPE("split", a, 0, LVAL_NUM);
+    LASSERT_TYPE("split", a, 1, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->num >= 0 && a->cell[0]->num <= a->cell[1]->count), "Function 'head' passed {}!");
+
+    lval* x = lval_qexpr();
+    lval_add(x, lval_split(a->cell[1], a->cell[0]->num, 1));
+    lval_add(x, lval_split(a->cell[1], a->cell[0]->num, 0));
+    lval_del(a);
     return x;
 }
 
-static lval* builtin_len(lenv* e, lval* a)
+static lval* builtin_elem(lenv* e, lval* a)
 {
-    LASSERT_NUM("len", a, 1);
-    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
-    
-    lval* x = lval_num(a->cell[0]->count);
+    LASSERT_NUM("elem", a, 2);
+    LASSERT_TYPE("elem", a, 1, LVAL_QEXPR);
+
+    lval* l = a->cell[1];
+    lval* x = lval_num(0);
+
+    for (int i = 0; i < l->count; i++) {
+        lval* v = lval_elem(e, l, i);
+        if(v->type == LVAL_ERR) { lval_del(x); x = v; break;}
+        
+        int found = lval_eq(a->cell[0], v);
+        lval_del(v);
+        if(found) { x->num = 1; break;}
+    }
+
     lval_del(a);
     return x;
 }
 
-static lval* builtin_cons(lenv* e, lval* a)
+static lval* builtin_zip(lenv* e, lval* a)
 {
-    LASSERT_NUM("cons", a, 2);
-    LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
-    
-    lval* x = lval_pop(a, 1);
-    x = lval_add_front(x, lval_take(a, 0)); 
+    LASSERT_NUM("zip", a, 2);
+    LASSERT_TYPE("zip", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("zip", a, 1, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    lval* r = a->cell[1];
+    lval* x = lval_qexpr();
+
+    for (int i = 0; i < l->count && i < r->count; i++) {
+        lval* p = lval_qexpr();
+        lval_add(p, lval_copy(l->cell[i]));
+        lval_add(p, lval_copy(r->cell[i]));
+        lval_add(x, p);
+    }
+
+    lval_del(a);
     return x;
 }
 
-static lval* builtin_list(lenv* e, lval* a)
+static lval* builtin_unzip(lenv* e, lval* a)
 {
-    a->type = LVAL_QEXPR;
-    return a;
+    LASSERT_NUM("unzip", a, 1);
+    LASSERT_TYPE("unzip", a, 0, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    for (int i = 0; i < l->count; i++) {
+        LASSERT(a, (l->cell[i]->type == LVAL_QEXPR && l->cell[i]->count == 2),
+                "Function 'unzip' passed incorrect element %i. Got %s, Expected pair.",
+                i, ltype_name(l->cell[i]->type));
+    }
+
+    lval* x = lval_qexpr();
+    lval* y = lval_qexpr();
+    for (int i = 0; i < l->count; i++) {
+        lval_add(x, lval_copy(l->cell[i]->cell[0]));
+        lval_add(y, lval_copy(l->cell[i]->cell[1]));
+    }
+
+    lval_del(a);
+    return lval_add(lval_add(lval_qexpr(), x), y);
 }
 
-static lval* builtin_eval(lenv* e, lval* a)
+// Lazy sequences
+//
+// A sequence value only describes a pipeline. Consuming one builds a chain
+// of cursors, one per stage, and pulls elements through it one at a time,
+// so nothing in between is ever materialized. Errors travel down the
+// pipeline as elements and end it.
+
+static lseq* lseq_new(int kind, lseq* src)
 {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-    
-    lval* x = lval_take(a,0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    lseq* s = malloc(sizeof(lseq));
+    s->refs = 1;
+    s->kind = kind;
+    s->src = src;
+    s->fun = NULL;
+    s->val = NULL;
+    s->start = 0;
+    s->end = 0;
+    s->step = 1;
+    return s;
 }
 
-static lval* lval_join(lval* x, lval* y)
+static void lseq_del(lseq* s)
 {
-    // for each cell in 'y' add it to 'x'
-    while(y->count){
-        x = lval_add(x, lval_pop(y, 0));
-    }
+    if(--s->refs) { return;}
     
-    // delete the empty 'y' and return 'x'
-    lval_del(y);
-    return x;
+    if(s->src) { lseq_del(s->src);}
+    if(s->fun) { lval_del(s->fun);}
+    if(s->val) { lval_del(s->val);}
+    free(s);
 }
 
-static lval* builtin_join(lenv* e, lval* a)
+static lval* lval_seq(lseq* s)
 {
-    for(int i = 0; i < a->count; i++) {LASSERT_TYPE("join", a, i, LVAL_QEXPR);}
-    
-    lval* x = lval_pop(a, 0);
-    
-    while(a->count) {
-        x = lval_join(x, lval_pop(a, 0));
-    }
-    
-    lval_del(a);
-    return x;
+    lval* v = lval_alloc(LVAL_SEQ);
+    v->seq = s;
+    return v;
 }
 
-lval* builtin_error(lenv* e, lval* a)
-{
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
+typedef struct lcur lcur;
 
-    lval* err = lval_err(a->cell[0]->str);
+struct lcur{
+    lseq* seq;
+    lcur* src;
+    lval* val;      // last value of iterate
+    long pos;       // next value of range, index into list, count left
+};
 
-    lval_del(a);
-    return err;
+static lcur* lcur_new(lseq* s)
+{
+    lcur* c = malloc(sizeof(lcur));
+    c->seq = s;
+    c->src = s->src ? lcur_new(s->src) : NULL;
+    c->val = NULL;
+    c->pos = s->kind == SEQ_LIST ? 0 : s->start;
+    return c;
 }
 
-static lval* builtin_var(lenv* e, lval* a, char* func)
+static void lcur_del(lcur* c)
 {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-    
-    //first element is symbol list
-    lval* syms = a->cell[0];
+    if(c->src) { lcur_del(c->src);}
+    if(c->val) { lval_del(c->val);}
+    free(c);
+}
 
-    for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function 'def' cannot define non-symbol!");
+//pull the next element into 'x', 0 once the sequence has ended
+static int lcur_next(lenv* e, lcur* c, lval** x)
+{
+    lseq* s = c->seq;
+
+    switch(s->kind){
+    case SEQ_RANGE:
+        if(s->step > 0 ? c->pos >= s->end : c->pos <= s->end) { return 0;}
+        *x = lval_num(c->pos);
+        c->pos += s->step;
+        return 1;
+
+    case SEQ_LIST:
+        if(c->pos == s->val->count) { return 0;}
+        *x = lval_copy(s->val->cell[c->pos++]);
+        return 1;
+
+    case SEQ_ITERATE:
+        if(c->val){
+            c->val = lval_apply(e, s->fun, lval_add(lval_sexpr(), c->val));
+        }else{
+            c->val = lval_copy(s->val);
+        }
+        *x = lval_copy(c->val);
+        return 1;
+
+    case SEQ_MAP:
+        if(!lcur_next(e, c->src, x)) { return 0;}
+        if((*x)->type != LVAL_ERR) { *x = lval_apply(e, s->fun, lval_add(lval_sexpr(), *x));}
+        return 1;
+
+    case SEQ_FILTER:
+        while(lcur_next(e, c->src, x)){
+            if((*x)->type == LVAL_ERR) { return 1;}
+            
+            lval* r = lval_apply(e, s->fun, lval_add(lval_sexpr(), lval_copy(*x)));
+            if(r->type != LVAL_NUM){
+                lval_del(*x);
+                *x = r->type == LVAL_ERR ? r : lval_err(
+                    "Function 'seq-filter' predicate returned incorrect type. Got %s, Expected %s.",
+                    ltype_name(r->type), ltype_name(LVAL_NUM));
+                if(*x != r) { lval_del(r);}
+                return 1;
+            }
+            
+            int keep = r->num != 0;
+            lval_del(r);
+            if(keep) { return 1;}
+            lval_del(*x);
+        }
+        return 0;
+
+    case SEQ_TAKE:
+        if(c->pos <= 0) { return 0;}
+        c->pos--;
+        return lcur_next(e, c->src, x);
+
+    case SEQ_DROP:
+        for (; c->pos > 0; c->pos--) {
+            if(!lcur_next(e, c->src, x)) { return 0;}
+            if((*x)->type == LVAL_ERR) { return 1;}
+            lval_del(*x);
+        }
+        return lcur_next(e, c->src, x);
     }
+    return 0;
+}
 
-    //check correct number of symbols and values
-    LASSERT(a, (syms->count == a->count-1), "Function 'def' cannot define incorrect number of values to symbols!");
+static lval* builtin_range(lenv* e, lval* a)
+{
+    LASSERT(a, (a->count >= 1 && a->count <= 3),
+            "Function 'range' passed incorrect number of arguments. Got %i, Expected 1 to 3.", a->count);
+    for (int i = 0; i < a->count; i++) {LASSERT_TYPE("range", a, i, LVAL_NUM);}
 
-    for (int i = 0; i < syms->count; i++) {
-        if(strcmp(func, "def") == 0) {lenv_def(e, syms->cell[i], a->cell[i+1]);}
-        if(strcmp(func, "=")== 0) {lenv_put(e, syms->cell[i], a->cell[i+1]);}
+    lseq* s = lseq_new(SEQ_RANGE, NULL);
+    if(a->count == 1){
+        s->end = a->cell[0]->num;
+    }else{
+        s->start = a->cell[0]->num;
+        s->end = a->cell[1]->num;
+    }
+    if(a->count == 3) { s->step = a->cell[2]->num;}
+    
+    if(s->step == 0){
+        lseq_del(s);
+        lval_del(a);
+        return lval_err("Function 'range' passed step 0!");
     }
 
     lval_del(a);
-    return lval_sexpr();
+    return lval_seq(s);
 }
 
-lval* builtin_def(lenv*e, lval* a) {return builtin_var(e, a, "def");}
-lval* builtin_put(lenv*e, lval* a) {return builtin_var(e, a, "=");}
+static lval* builtin_iterate(lenv* e, lval* a)
+{
+    LASSERT_NUM("iterate", a, 2);
+    LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
 
-static lval* builtin_exit(lenv* e, lval* a)
+    lseq* s = lseq_new(SEQ_ITERATE, NULL);
+    s->fun = lval_pop(a, 0);
+    s->val = lval_take(a, 0);
+    return lval_seq(s);
+}
+
+static lval* builtin_seq(lenv* e, lval* a)
 {
-    exit(EXIT_SUCCESS); 
+    LASSERT_NUM("seq", a, 1);
+    if(a->cell[0]->type == LVAL_SEQ) { return lval_take(a, 0);}
+    LASSERT_TYPE("seq", a, 0, LVAL_QEXPR);
+
+    lseq* s = lseq_new(SEQ_LIST, NULL);
+    s->val = lval_take(a, 0);
+    return lval_seq(s);
 }
 
-lval* builtin_if(lenv* e, lval* a)
+//sequences of map and filter
+static lval* builtin_seq_fun(lenv* e, lval* a, int kind, char* func)
 {
-    LASSERT_NUM("if", a, 3); 
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);  
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);  
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);  
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_TYPE(func, a, 1, LVAL_SEQ);
+
+    lval* src = a->cell[1];
+    lseq* s = lseq_new(kind, src->seq);
+    src->seq->refs++;
+    s->fun = lval_pop(a, 0);
     
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    lval_del(a);
+    return lval_seq(s);
+}
 
-    if(a->cell[0]->num){
-        x = lval_eval(e, lval_pop(a, 1));
-    }else{
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+static lval* builtin_seq_map(lenv* e, lval* a) { return builtin_seq_fun(e, a, SEQ_MAP, "seq-map");}
+static lval* builtin_seq_filter(lenv* e, lval* a) { return builtin_seq_fun(e, a, SEQ_FILTER, "seq-filter");}
+
+//sequences of take and drop
+static lval* builtin_seq_count(lenv* e, lval* a, int kind, char* func)
+{
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_NUM);
+    LASSERT_TYPE(func, a, 1, LVAL_SEQ);
+
+    lseq* s = lseq_new(kind, a->cell[1]->seq);
+    a->cell[1]->seq->refs++;
+    s->start = a->cell[0]->num;
 
     lval_del(a);
-    return x;
+    return lval_seq(s);
 }
 
-static lval* builtin_lambda(lenv* e, lval* a)
+static lval* builtin_seq_take(lenv* e, lval* a) { return builtin_seq_count(e, a, SEQ_TAKE, "seq-take");}
+static lval* builtin_seq_drop(lenv* e, lval* a) { return builtin_seq_count(e, a, SEQ_DROP, "seq-drop");}
+
+static lval* builtin_realize(lenv* e, lval* a)
 {
-    //check two arguments, each of which are Q-expression
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+    LASSERT_NUM("realize", a, 1);
+    LASSERT_TYPE("realize", a, 0, LVAL_SEQ);
+
+    lval* q = lval_qexpr();
+    lval* x;
+    lcur* c = lcur_new(a->cell[0]->seq);
     
-    //check first Q-expression contains only Symbols
-    for (int i = 0; i <  a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-                "Cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_QEXPR));
+    while(lcur_next(e, c, &x)){
+        if(x->type == LVAL_ERR) { lval_del(q); q = x; break;}
+        lval_add(q, x);
     }
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
 
-    return lval_lambda(formals, body);
+    lcur_del(c);
+    lval_del(a);
+    return q;
 }
 
-lval* lval_call(lenv* e, lval* f, lval*a)
+static lval* builtin_seq_fold(lenv* e, lval* a)
 {
-    //if builtin then simply call that
-    if(f->builtin) {return f->builtin(e, a);}
-    
-    //record argument counts
-    int given = a->count;
-    int total = f->formals->count;
+    LASSERT_NUM("seq-fold", a, 3);
+    LASSERT_TYPE("seq-fold", a, 0, LVAL_FUN);
+    LASSERT_TYPE("seq-fold", a, 2, LVAL_SEQ);
 
-    //while arguments still remain to be processed
-    while(a->count){
-        //if we've ran out of formal arguments to bind
-        if(f->formals->count == 0){
-            lval_del(a);
-            return lval_err("Function passed too many arguments. Got %i, Expected %i", given, total);
-        }
-            
-        //pop the first symbol from the formals
-        lval* sym = lval_pop(f->formals, 0);
-        
-        //special case to deal with '&'
-        if(strcmp(sym->sym, "&") == 0){
-            //ensure '&' is followed by another symbol
-            if(f->formals->count != 1){
-                lval_del(a);
-                return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-            }
-            
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym); lval_del(nsym);
-            break;
-        }
-        //pop the next argument from the list
-        lval* val = lval_pop(a, 0);
-        
-        //bind a copy into function's environment
-        lenv_put(f->env, sym, val);
-
-        //delete symbol and value
-        lval_del(sym);lval_del(val);
+    lval* f = a->cell[0];
+    lval* z = lval_copy(a->cell[1]);
+    lval* x;
+    lcur* c = lcur_new(a->cell[2]->seq);
+    
+    while(lcur_next(e, c, &x)){
+        if(x->type == LVAL_ERR) { lval_del(z); z = x; break;}
+        z = lval_apply(e, f, lval_add(lval_add(lval_sexpr(), z), x));
+        if(z->type == LVAL_ERR) { break;}
     }
 
+    lcur_del(c);
     lval_del(a);
+    return z;
+}
 
-    //if '&' remains in formal list it should be bound to empty list
-    if(f->formals->count > 0 && 
-       strcmp(f->formals->cell[0]->sym, "&") == 0){
-        //check to ensure that & is not passed invalidly
-        if(f->formals->count != 2){
-            return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
-        }
+//reductions over numbers run natively without calling back. 'op' is OP_ADD
+//or OP_MUL, whose totals go on as bignums once they overflow, or -1 to count
+static lval* builtin_seq_reduce(lenv* e, lval* a, int op, char* func)
+{
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_SEQ);
+
+    long r = op == OP_MUL;
+    lbig* b = NULL;  // the total once it left the range of a long
+    double f = 0;
+    int dbl = 0;     // switches to the double total after the first double
+    long n = 0;
+    lval* x;
+    lval* err = NULL;
+    lcur* c = lcur_new(a->cell[0]->seq);
+    
+    while(!err && lcur_next(e, c, &x)){
+        if(x->type == LVAL_ERR) { err = x; break;}
         
-        //pop and delete '&' symbol
-        lval_del(lval_pop(f->formals, 0));
-
-        //pop next symbol and create empty list
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
-
-        //bind to environment and delete
-        lenv_put(f->env, sym, val);
-        lval_del(sym);lval_del(val);
+        long t;
+        if(op < 0){
+            r++;
+        }else if(x->type != LVAL_NUM && x->type != LVAL_DBL && x->type != LVAL_BIG){
+            err = lval_err("Function '%s' passed incorrect type for element %li. Got %s, Expected %s.",
+                           func, n, ltype_name(x->type), ltype_name(LVAL_NUM));
+        }else if(x->type == LVAL_DBL || dbl){
+            if(!dbl) { f = b ? lbig_to_dbl(b) : r; dbl = 1;}
+            if(b) { lbig_del(b); b = NULL;}
+            f = op == OP_ADD ? f + lval_to_dbl(x) : f * lval_to_dbl(x);
+        }else if(!b && x->type == LVAL_NUM
+                 && !(op == OP_ADD ? __builtin_add_overflow(r, x->num, &t) : __builtin_mul_overflow(r, x->num, &t))){
+            r = t;
+        }else{
+            //carry on in arbitrary precision from the element that overflowed
+            if(!b) { b = lbig_from_long(r);}
+            lbig* y = lbig_of(x);
+            lbig* s = op == OP_ADD ? lbig_add(b, y, 0) : lbig_mul(b, y);
+            lbig_del(b);
+            lbig_del(y);
+            b = s;
+        }
+        n++;
+        if(x != err) { lval_del(x);}
     }
 
-    //if all formals have been bound evalute
-    if(f->formals->count ==0){
-        
-        f->env->par =e;
-    
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    }else{
-        //otherwise return partially evaluted function
-        return lval_copy(f);
-    }
+    lcur_del(c);
+    lval_del(a);
+    if(err) { if(b) { lbig_del(b);} return err;}
+    if(dbl) { return lval_dbl(f);}
+    return b ? lval_big(b) : lval_num(r);
 }
 
+static lval* builtin_seq_sum(lenv* e, lval* a) { return builtin_seq_reduce(e, a, OP_ADD, "seq-sum");}
+static lval* builtin_seq_product(lenv* e, lval* a) { return builtin_seq_reduce(e, a, OP_MUL, "seq-product");}
+static lval* builtin_seq_length(lenv* e, lval* a) { return builtin_seq_reduce(e, a, -1, "seq-count");}
+
 static void lenv_add_builtin(lenv* e, char* name, lbuiltin func)
 {
     lval* k = lval_sym(name);
@@ -974,24 +6160,124 @@ static void lenv_add_builtins(lenv *e)
     lenv_add_builtin(e, "head", builtin_head);
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "do", builtin_do);
+    lenv_add_builtin(e, "let", builtin_let);
     lenv_add_builtin(e, "join", builtin_join);
     lenv_add_builtin(e, "cons", builtin_cons);
     lenv_add_builtin(e, "init", builtin_init);
     lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "reverse", builtin_reverse);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "foldr", builtin_foldr);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "split", builtin_split);
+    lenv_add_builtin(e, "elem", builtin_elem);
+    lenv_add_builtin(e, "zip", builtin_zip);
+    lenv_add_builtin(e, "unzip", builtin_unzip);
     lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+    lenv_add_builtin(e, "seal", builtin_seal);
+    lenv_add_builtin(e, "hashcons", builtin_hashcons);
     lenv_add_builtin(e, "exit", builtin_exit);
     lenv_add_builtin(e, "print", builtin_print);
     lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "try", builtin_try);
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "type-of", builtin_type_of);
     lenv_add_builtin(e, "=", builtin_put);
     lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+    //maps
+    lenv_add_builtin(e, "map-new", builtin_map_new);
+    lenv_add_builtin(e, "map-get", builtin_map_get);
+    lenv_add_builtin(e, "map-put", builtin_map_put);
+    lenv_add_builtin(e, "map-del", builtin_map_del);
+    lenv_add_builtin(e, "map-keys", builtin_map_keys);
+    lenv_add_builtin(e, "map-count", builtin_map_count);
+
+    //vectors
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vec-ref", builtin_vec_ref);
+    lenv_add_builtin(e, "vec-set!", builtin_vec_set);
+    lenv_add_builtin(e, "vec-push", builtin_vec_push);
+    lenv_add_builtin(e, "vec-len", builtin_vec_len);
+    lenv_add_builtin(e, "vec-slice", builtin_vec_slice);
+    lenv_add_builtin(e, "vec->list", builtin_vec_list);
+    lenv_add_builtin(e, "list->vec", builtin_list_vec);
+
+    //typed arrays
+    lenv_add_builtin(e, "array", builtin_array);
+    lenv_add_builtin(e, "array-range", builtin_array_range);
+    lenv_add_builtin(e, "array-len", builtin_array_len);
+    lenv_add_builtin(e, "array-ref", builtin_array_ref);
+    lenv_add_builtin(e, "array->list", builtin_array_list);
+    lenv_add_builtin(e, "array-sum", builtin_array_sum);
+    lenv_add_builtin(e, "array-product", builtin_array_product);
+    lenv_add_builtin(e, "array-min", builtin_array_min);
+    lenv_add_builtin(e, "array-max", builtin_array_max);
+    lenv_add_builtin(e, "array-dot", builtin_array_dot);
+    lenv_add_builtin(e, "array-scan", builtin_array_scan);
+    lenv_add_builtin(e, "array-add", builtin_array_add);
+    lenv_add_builtin(e, "array-sub", builtin_array_sub);
+    lenv_add_builtin(e, "array-mul", builtin_array_mul);
+    lenv_add_builtin(e, "array-div", builtin_array_div);
+    lenv_add_builtin(e, "array-lt", builtin_array_lt);
+    lenv_add_builtin(e, "array-gt", builtin_array_gt);
+    lenv_add_builtin(e, "array-eq", builtin_array_eq);
+
+    //matrices
+    lenv_add_builtin(e, "mat", builtin_mat);
+    lenv_add_builtin(e, "mat-rows", builtin_mat_rows);
+    lenv_add_builtin(e, "mat-ref", builtin_mat_ref);
+    lenv_add_builtin(e, "mat-cols", builtin_mat_cols);
+    lenv_add_builtin(e, "mat-t", builtin_mat_t);
+    lenv_add_builtin(e, "mat-mul", builtin_mat_mul);
+    lenv_add_builtin(e, "mat-vec", builtin_mat_vec);
+    lenv_add_builtin(e, "mat-row-sums", builtin_mat_row_sums);
+    lenv_add_builtin(e, "mat-col-sums", builtin_mat_col_sums);
+
+    //strings
+    lenv_add_builtin(e, "concat", builtin_concat);
+    lenv_add_builtin(e, "substring", builtin_substring);
+    lenv_add_builtin(e, "str-index", builtin_str_index);
+    lenv_add_builtin(e, "str-split", builtin_str_split);
+    lenv_add_builtin(e, "str-join", builtin_str_join);
+    lenv_add_builtin(e, "str-replace", builtin_str_replace);
+    lenv_add_builtin(e, "upcase", builtin_upcase);
+    lenv_add_builtin(e, "downcase", builtin_downcase);
+    lenv_add_builtin(e, "format", builtin_format);
+    lenv_add_builtin(e, "sb-new", builtin_sb_new);
+    lenv_add_builtin(e, "sb-append", builtin_sb_append);
+    lenv_add_builtin(e, "sb-string", builtin_sb_string);
+    lenv_add_builtin(e, "sb-len", builtin_sb_len);
+    
+    //lazy sequences
+    lenv_add_builtin(e, "range", builtin_range);
+    lenv_add_builtin(e, "iterate", builtin_iterate);
+    lenv_add_builtin(e, "seq", builtin_seq);
+    lenv_add_builtin(e, "realize", builtin_realize);
+    lenv_add_builtin(e, "seq-map", builtin_seq_map);
+    lenv_add_builtin(e, "seq-filter", builtin_seq_filter);
+    lenv_add_builtin(e, "seq-take", builtin_seq_take);
+    lenv_add_builtin(e, "seq-drop", builtin_seq_drop);
+    lenv_add_builtin(e, "seq-fold", builtin_seq_fold);
+    lenv_add_builtin(e, "seq-sum", builtin_seq_sum);
+    lenv_add_builtin(e, "seq-product", builtin_seq_product);
+    lenv_add_builtin(e, "seq-count", builtin_seq_length);
     
     //mathematical functions
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
     
     //ord functions
     lenv_add_builtin(e, ">", builtin_gt);
@@ -1004,6 +6290,13 @@ static void lenv_add_builtins(lenv *e)
     lenv_add_builtin(e, "!=", builtin_ne);
     //if
     lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "cond", builtin_cond);
+    lenv_add_builtin(e, "case", builtin_case);
+    lenv_add_builtin(e, "match", builtin_match);
+    lenv_add_builtin(e, "and", builtin_and);
+    lenv_add_builtin(e, "or", builtin_or);
+    lenv_add_builtin(e, "loop", builtin_loop);
+    lenv_add_builtin(e, "recur", builtin_recur);
 } 
 
 /*
@@ -1061,7 +6354,7 @@ void interpreter(lenv* e, mpc_parser_t* Lispy){
             //mpc_ast_print(r.output);
             lval* result = lval_read(r.output);
             //lval_println(result);
-            lval* x = lval_eval(e, result); 
+            lval* x = lval_eval(e, lmacro_expand(e, result, 0)); 
             lval_println(x);
             lval_del(x);
 
@@ -1077,11 +6370,13 @@ void interpreter(lenv* e, mpc_parser_t* Lispy){
 int main(int argc, char ** argv){
     // create some parsers
     Number = mpc_new("number");
+    Double = mpc_new("double");
     Symbol = mpc_new("symbol");
     String = mpc_new("string");
     Comment = mpc_new("comment");
     Sexpr = mpc_new("sexpr");
     Qexpr = mpc_new("qexpr");
+    Map = mpc_new("map");
     Expr = mpc_new("expr");
     Lispy = mpc_new("lispy");
 
@@ -1089,15 +6384,17 @@ int main(int argc, char ** argv){
     mpca_lang(MPC_LANG_DEFAULT,
               "                                                               \
               number  : /-?[0-9]+/;                                           \
-              symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;                      \
+              double  : /-?[0-9]+\\.[0-9]+([eE][-+]?[0-9]+)?/;              \
+              symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/;                     \
               string  : /\"(\\\\.|[^\"])*\"/;                                 \
               comment : /;[^\\r\\n]*/;                                        \
               sexpr   : '(' <expr>* ')';                                      \
               qexpr   : '{' <expr>* '}';                                      \
-              expr    : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr>; \
+              map     : \"#{\" <expr>* '}';                                   \
+              expr    : <double> | <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> | <map>; \
               lispy   : /^/ <expr>* /$/;                                      \
               ",
-              Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+              Number, Double, Symbol, String, Comment, Sexpr, Qexpr, Map, Expr, Lispy);
 
 
     lenv* e =lenv_new();
@@ -1124,7 +6421,7 @@ int main(int argc, char ** argv){
     
     lenv_del(e);
 
-    mpc_cleanup(4, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    mpc_cleanup(10, Number, Double, Symbol, String, Comment, Sexpr, Qexpr, Map, Expr, Lispy);
 
     return 0;
 }